@@ -0,0 +1,317 @@
+/*-
+ * Copyright (c) 2018 Matthew Naylor
+ * Copyright (c) 2018 Jonathan Woodruff
+ * Copyright (c) 2018 Alexandre Joannou
+ * Copyright (c) 2018 Hesham Almatary
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology) under DARPA contract HR0011-18-C-0016 ("ECATS"), as part of the
+ * DARPA SSITH research programme.
+ *
+ * This software was partly developed by the University of Cambridge
+ * Computer Laboratory as part of the Partially-Ordered Event-Triggered
+ * Systems (POETS) project, funded by EPSRC grant EP/N031768/1.
+ *
+ * @BERI_LICENSE_HEADER_START@
+ *
+ * Licensed to BERI Open Systems C.I.C. (BERI) under one or more contributor
+ * license agreements.  See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.  BERI licenses this
+ * file to you under the BERI Hardware-Software License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at:
+ *
+ *   http://www.beri-open-systems.org/legal/license-1-0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, Work distributed
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ * CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ *
+ * @BERI_LICENSE_HEADER_END@
+ */
+
+// Throughput and latency benchmark for the socket packet utils
+//
+// Build with:
+//   cc -O2 -o socket_packet_bench socket_packet_bench.c socket_packet_utils.c -lpthread -lrt
+//
+// The benchmark forks: the parent drives the serv_socket_* side, as a
+// simulator would, and the child the client_socket_* side, as a host tool
+// would. Both use the socket name BENCH, so the transport and buffering
+// under test are selected with the usual environment variables (BENCH_PORT,
+// BENCH_PATH, BENCH_SHM, BENCH_IO_THREAD, BENCH_TX_COMBINE, ...).
+//
+// Results are written as one JSON object per line, to stdout or to the file
+// given with -o (the library itself logs to stdout, unless
+// SOCKET_PACKET_UTILS_LOG_LEVEL is set to none).
+
+#include "socket_packet_utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define BENCH_NAME "BENCH"
+#define BENCH_DFLT_PORT 3456
+#define MAX_SIZES 32
+#define MAX_PKT_SZ 65536
+
+// Benchmark configuration, identical in both processes
+typedef struct {
+  long packets;
+  long round_trips;
+  int nsizes;
+  int sizes[MAX_SIZES];
+  FILE * out;
+} bench_cfg_t;
+
+uint64_t nowNs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Blocking helpers built on the non-blocking API
+////////////////////////////////////////////////////////////////////////////////
+void servPut(unsigned long long s, int nbytes, uint8_t * buf)
+{
+  if (nbytes == 1) while (!serv_socket_put8(s, buf[0]));
+  else while (!serv_socket_putN(s, nbytes, (unsigned int *) buf));
+}
+
+void servGet(unsigned long long s, int nbytes, uint8_t * buf)
+{
+  if (nbytes == 1) {
+    uint32_t b;
+    while ((b = serv_socket_get8(s)) == (uint32_t) -1);
+    buf[0] = b;
+  } else do serv_socket_getN(buf, s, nbytes); while (buf[nbytes]);
+}
+
+void clientPut(unsigned long long c, int nbytes, uint8_t * buf)
+{
+  if (nbytes == 1) while (!client_socket_put8(c, buf[0]));
+  else while (!client_socket_putN(c, nbytes, (unsigned int *) buf));
+}
+
+void clientGet(unsigned long long c, int nbytes, uint8_t * buf)
+{
+  if (nbytes == 1) {
+    uint32_t b;
+    while ((b = client_socket_get8(c)) == (uint32_t) -1);
+    buf[0] = b;
+  } else do client_socket_getN(buf, c, nbytes); while (buf[nbytes]);
+}
+
+// Flushes only write what the connection takes, so are repeated until
+// nothing is left pending (with write combining, the tail of the last
+// packet would otherwise never go out)
+void servFlush(unsigned long long s)
+{
+  while (!serv_socket_flush(s));
+}
+
+void clientFlush(unsigned long long c)
+{
+  while (!client_socket_flush(c));
+}
+
+// Wait for the other process to signal the end of a test
+void servSync(unsigned long long s, uint8_t * buf)
+{
+  servFlush(s);
+  servGet(s, 1, buf);
+}
+
+void clientSync(unsigned long long c, uint8_t * buf)
+{
+  buf[0] = 0;
+  clientPut(c, 1, buf);
+  clientFlush(c);
+}
+
+// Reporting
+////////////////////////////////////////////////////////////////////////////////
+int cmpU64(const void * a, const void * b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+void reportThroughput(bench_cfg_t * cfg, const char * test, int nbytes, uint64_t ns)
+{
+  double secs = ns * 1e-9;
+  fprintf(cfg->out, "{\"test\": \"%s\", \"nbytes\": %d, \"packets\": %ld, "
+          "\"seconds\": %.6f, \"packets_per_sec\": %.1f, \"bytes_per_sec\": %.1f}\n",
+          test, nbytes, cfg->packets, secs, cfg->packets / secs,
+          cfg->packets * (double) nbytes / secs);
+  fflush(cfg->out);
+}
+
+void reportLatency(bench_cfg_t * cfg, const char * test, int nbytes, uint64_t * rtt)
+{
+  long n = cfg->round_trips;
+  qsort(rtt, n, sizeof(uint64_t), cmpU64);
+  fprintf(cfg->out, "{\"test\": \"%s\", \"nbytes\": %d, \"round_trips\": %ld, "
+          "\"rtt_min_us\": %.3f, \"rtt_p50_us\": %.3f, \"rtt_p90_us\": %.3f, "
+          "\"rtt_p99_us\": %.3f, \"rtt_p999_us\": %.3f, \"rtt_max_us\": %.3f}\n",
+          test, nbytes, n, rtt[0] * 1e-3, rtt[n / 2] * 1e-3, rtt[n * 9 / 10] * 1e-3,
+          rtt[n * 99 / 100] * 1e-3, rtt[n * 999 / 1000] * 1e-3, rtt[n - 1] * 1e-3);
+  fflush(cfg->out);
+}
+
+// Tests. Every test runs in both processes, each playing its side.
+////////////////////////////////////////////////////////////////////////////////
+
+// Server to client stream: put8/putN throughput
+void benchServToClient(bench_cfg_t * cfg, bool server, unsigned long long h, int nbytes, uint8_t * buf)
+{
+  if (server) {
+    uint64_t t0 = nowNs();
+    for (long i = 0; i < cfg->packets; i++) {
+      buf[0] = (uint8_t) i;
+      servPut(h, nbytes, buf);
+    }
+    servSync(h, buf);
+    reportThroughput(cfg, nbytes == 1 ? "put8" : "putN", nbytes, nowNs() - t0);
+  } else {
+    for (long i = 0; i < cfg->packets; i++) clientGet(h, nbytes, buf);
+    clientSync(h, buf);
+  }
+}
+
+// Client to server stream: get8/getN throughput
+void benchClientToServ(bench_cfg_t * cfg, bool server, unsigned long long h, int nbytes, uint8_t * buf)
+{
+  if (server) {
+    // Time from telling the client to start until the last packet arrives
+    uint64_t t0 = nowNs();
+    buf[0] = 0;
+    servPut(h, 1, buf);
+    servFlush(h);
+    for (long i = 0; i < cfg->packets; i++) servGet(h, nbytes, buf);
+    reportThroughput(cfg, nbytes == 1 ? "get8" : "getN", nbytes, nowNs() - t0);
+  } else {
+    clientGet(h, 1, buf);
+    for (long i = 0; i < cfg->packets; i++) {
+      buf[0] = (uint8_t) i;
+      clientPut(h, nbytes, buf);
+    }
+    clientFlush(h);
+  }
+}
+
+// Server to client and back round trips
+void benchRoundTrip(bench_cfg_t * cfg, bool server, unsigned long long h, int nbytes, uint8_t * buf)
+{
+  if (server) {
+    uint64_t * rtt = (uint64_t *) malloc (cfg->round_trips * sizeof(uint64_t));
+    if (rtt == NULL) {
+      fprintf(stderr, "ERROR: could not allocate latency samples\n");
+      exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < cfg->round_trips; i++) {
+      buf[0] = (uint8_t) i;
+      uint64_t t0 = nowNs();
+      servPut(h, nbytes, buf);
+      servFlush(h);
+      servGet(h, nbytes, buf);
+      rtt[i] = nowNs() - t0;
+    }
+    reportLatency(cfg, nbytes == 1 ? "rtt8" : "rttN", nbytes, rtt);
+    free(rtt);
+  } else {
+    for (long i = 0; i < cfg->round_trips; i++) {
+      clientGet(h, nbytes, buf);
+      clientPut(h, nbytes, buf);
+      clientFlush(h);
+    }
+  }
+}
+
+void runBench(bench_cfg_t * cfg, bool server, unsigned long long h)
+{
+  uint8_t * buf = (uint8_t *) calloc (MAX_PKT_SZ + 1, 1);
+  if (buf == NULL) {
+    fprintf(stderr, "ERROR: could not allocate packet buffer\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < cfg->nsizes; i++) {
+    int nbytes = cfg->sizes[i];
+    benchServToClient(cfg, server, h, nbytes, buf);
+    benchClientToServ(cfg, server, h, nbytes, buf);
+    benchRoundTrip(cfg, server, h, nbytes, buf);
+  }
+  free(buf);
+}
+
+void usage(const char * prog)
+{
+  fprintf(stderr, "Usage: %s [-n packets] [-r round_trips] [-s size,size,...] [-o output]\n", prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char ** argv)
+{
+  bench_cfg_t cfg;
+  cfg.packets = 100000;
+  cfg.round_trips = 10000;
+  cfg.nsizes = 0;
+  cfg.out = stdout;
+  const char * sizes = "1,4,8,16,64,256,1024,4096";
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:s:o:")) != -1) {
+    switch (opt) {
+      case 'n': cfg.packets = atol(optarg); break;
+      case 'r': cfg.round_trips = atol(optarg); break;
+      case 's': sizes = optarg; break;
+      case 'o':
+        cfg.out = fopen(optarg, "w");
+        if (cfg.out == NULL) {
+          perror("fopen");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      default: usage(argv[0]);
+    }
+  }
+  for (const char * p = sizes; *p != '\0' && cfg.nsizes < MAX_SIZES; ) {
+    int sz = atoi(p);
+    if (sz < 1 || sz > MAX_PKT_SZ) usage(argv[0]);
+    cfg.sizes[cfg.nsizes++] = sz;
+    p = strchr(p, ',');
+    if (p == NULL) break;
+    p++;
+  }
+  if (cfg.packets < 1 || cfg.round_trips < 1 || cfg.nsizes == 0) usage(argv[0]);
+
+  // Listen before forking so that the client can connect straight away
+  unsigned long long s = serv_socket_create(BENCH_NAME, BENCH_DFLT_PORT);
+  serv_socket_init(s);
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    unsigned long long c = client_socket_create(BENCH_NAME, BENCH_DFLT_PORT);
+    client_socket_init(c);
+    runBench(&cfg, false, c);
+    exit(EXIT_SUCCESS);
+  }
+  runBench(&cfg, true, s);
+  int status;
+  waitpid(pid, &status, 0);
+  if (cfg.out != stdout) fclose(cfg.out);
+  return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
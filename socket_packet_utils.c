@@ -40,12 +40,20 @@
  * @BERI_LICENSE_HEADER_END@
  */
 
+// For accept4()
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "socket_packet_utils.h"
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <ctype.h>
 #include <assert.h>
 #include <sys/types.h>
@@ -58,7 +66,34 @@
 #include <assert.h>
 #include <signal.h>
 #include <string.h>
+#include <strings.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#if !defined(SOCKET_PACKET_UTILS_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define IO_URING_BACKEND
+#endif
+#endif
+#endif
+#endif
 
 // The SOCKET_PACKET_UTILS_DFLT_SOCKET_NAME environment variable allows one to
 // use the socket packet utils library from a host language which does not have
@@ -70,6 +105,93 @@
 // General helpers
 ////////////////////////////////////////////////////////////////////////////////
 #define STR_BUFF_SZ 256
+#define RX_BUFF_SZ 65536
+#define RING_ALIGN 64
+#define DFLT_SHM_RING_SZ (1 << 20)
+#define SHM_MAGIC 0x53505553
+#define POLL_SET_MAX 64
+#define WAIT_LOCAL_FDS 64
+#define DFLT_PUT_TIMEOUT_MS 1000000
+#define DFLT_CONNECT_TIMEOUT_MS 10000
+#define DFLT_RECONNECT_MS 10
+#define DFLT_RECONNECT_MAX_MS 1000
+#define DFLT_BACKOFF_MAX 64
+#define BACKOFF_IDLE_POLLS 16
+#define DFLT_FANOUT_SZ (1 << 20)
+#define MC_ACCEPT_CALLS 64
+#define DFLT_BACKLOG SOMAXCONN
+#define MSG_HDR_MAX 5
+#define DELIMS_MAX 16
+#define TRACE_MAGIC 0x4543415254555053ull
+#define TRACE_CHUNK_SZ (16 << 20)
+#define TRACE_GET 0
+#define TRACE_PUT 1
+#define BULK_SOCK_BUF_SZ (4 << 20)
+#define LOW_LATENCY_BUSY_POLL_US 50
+#define BULK_MAGIC 0x42555053
+#define BULK_DATA 0
+#define BULK_PATH 1
+#define BULK_CHUNK_SZ (1 << 20)
+#define LAT_SUB_BITS 5
+#define LAT_SUB_BKTS (1 << LAT_SUB_BITS)
+#define LAT_BKTS ((64 - LAT_SUB_BITS + 1) * LAT_SUB_BKTS)
+#define LAT_MARKS 1024
+#define UR_ENTRIES 256
+#define UR_BUFS 256
+#define UR_BUF_SZ 16384
+#define UR_SOCK_BUFS 16
+#define UR_EXIT_MS 1000
+#define UR_WAIT_MS 10
+#define REGISTRY_CHUNK_SZ 64
+#define REGISTRY_MAX_CHUNKS 1024
+// A handle holds its state's index plus one in the low bits and the
+// generation of that state in the high bits
+#define HANDLE_INDEX(h) ((h) & 0xffffffffULL)
+#define HANDLE_GEN(h) ((h) >> 32)
+#define STATE_STRIDE ((sizeof(serv_socket_state_t) + RING_ALIGN - 1) & ~(size_t) (RING_ALIGN - 1))
+// Bytes of a socket state holding the fields the hot path touches
+#define HOT_STATE_SZ (7 * RING_ALIGN)
+#define LOG_MSG_SZ 1024
+
+// Log level, -1 until read from SOCKET_PACKET_UTILS_LOG_LEVEL, and the
+// handler messages go to instead of stdout and stderr, if any
+_Atomic int log_level = -1;
+socket_packet_log_fn log_fn = NULL;
+void* log_arg = NULL;
+
+int logLevel(void)
+{
+  int level = atomic_load_explicit(&log_level, memory_order_relaxed);
+  if (level != -1) return level;
+  const char* names[5] = {"none", "error", "warn", "info", "debug"};
+  char* env = getenv("SOCKET_PACKET_UTILS_LOG_LEVEL");
+  level = SOCKET_LOG_INFO;
+  if (env != NULL && isdigit((unsigned char) env[0])) level = atoi(env);
+  else if (env != NULL) {
+    for (int i = 0; i < 5; i++) if (strcasecmp(env, names[i]) == 0) level = i;
+  }
+  // Unless set meanwhile by socket_packet_set_log_level
+  int unset = -1;
+  atomic_compare_exchange_strong(&log_level, &unset, level);
+  return atomic_load_explicit(&log_level, memory_order_relaxed);
+}
+
+// Log a message at the given level, formatting it only if the level is
+// enabled. Warnings and errors go to stderr and the rest to stdout, as
+// "---- " lines, errors marked "ERROR: ", unless a handler is set. Fatal
+// errors are logged this way before exiting.
+void logMsg(int level, const char * fmt, ...)
+{
+  if (level > logLevel()) return;
+  char msg[LOG_MSG_SZ];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, args);
+  va_end(args);
+  if (log_fn != NULL) log_fn(level, msg, log_arg);
+  else fprintf(level <= SOCKET_LOG_WARN ? stderr : stdout, "---- %s%s\n",
+               level == SOCKET_LOG_ERROR ? "ERROR: " : "", msg);
+}
 
 int getPortNumber(const char * name, unsigned int dflt_port)
 {
@@ -79,336 +201,4736 @@ int getPortNumber(const char * name, unsigned int dflt_port)
   int port = -1;
   if (s != NULL) port = atoi(s);
   else {
-    printf("---- %s environment variable not defined, using default port %d instead\n", env_var_name, dflt_port);
+    logMsg(SOCKET_LOG_INFO, "%s environment variable not defined, using default port %d instead", env_var_name, dflt_port);
     port = (int) dflt_port;
   }
   assert(port >= 0 && port <= 65535);
   return port;
 }
 
+// Unix domain socket path from the <name>_PATH environment variable. Returns
+// false, leaving path empty, if it is not defined and TCP should be used.
+bool getSocketPath(const char * name, char * path, size_t path_sz)
+{
+  char env_var_name[STR_BUFF_SZ+5];
+  sprintf(env_var_name, "%s_PATH", name);
+  char* s = getenv(env_var_name);
+  path[0] = '\0';
+  if (s == NULL) return false;
+  if (strlen(s) >= path_sz) {
+    logMsg(SOCKET_LOG_ERROR, "%s is too long for a unix domain socket path", env_var_name);
+    exit(EXIT_FAILURE);
+  }
+  strcpy(path, s);
+  return true;
+}
+
+// Look up the <name>_<suffix> environment variable, NULL if not defined
+char* getSocketEnv(const char * name, const char * suffix)
+{
+  char env_var_name[STR_BUFF_SZ+32];
+  snprintf(env_var_name, sizeof(env_var_name), "%s_%s", name, suffix);
+  return getenv(env_var_name);
+}
+
+// Integer valued <name>_<suffix> environment variable, or dflt if not defined
+long getSocketEnvInt(const char * name, const char * suffix, long dflt)
+{
+  char* s = getSocketEnv(name, suffix);
+  if (s == NULL) return dflt;
+  return strtol(s, NULL, 0);
+}
+
+// Monotonic clock in nanoseconds
+uint64_t monotonicNs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 // Make a socket non-blocking
 void socketSetNonBlocking(int sock)
 {
   int flags = fcntl(sock, F_GETFL, 0);
   if (flags == -1) {
-    perror("fcntl");
+    logMsg(SOCKET_LOG_ERROR, "could not make a socket non-blocking: %s", strerror(errno));
     exit(EXIT_FAILURE);
   }
   int ret = fcntl(sock, F_SETFL, flags|O_NONBLOCK);
   if (ret == -1) {
-    perror("fcntl");
+    logMsg(SOCKET_LOG_ERROR, "could not make a socket non-blocking: %s", strerror(errno));
     exit(EXIT_FAILURE);
   }
 }
 
-// state for a server
-typedef struct {
-  char name[STR_BUFF_SZ];
-  int port;
-  int sock;
-  int conn;
-} serv_socket_state_t;
+// Decode the varint (LEB128) length prefix of a message from the avail
+// bytes at buf, returning the prefix size, 0 if it is incomplete or -1 if
+// it is malformed
+int msgHeader(const uint8_t* buf, size_t avail, size_t* len)
+{
+  uint64_t n = 0;
+  for (int i = 0; i < MSG_HDR_MAX; i++) {
+    if ((size_t) i == avail) return 0;
+    n |= (uint64_t) (buf[i] & 0x7f) << (7*i);
+    if (!(buf[i] & 0x80)) {
+      if (n > INT_MAX) return -1;
+      *len = n;
+      return i+1;
+    }
+  }
+  return -1;
+}
 
-unsigned long long socket_create(const char * name, unsigned int dflt_port)
+// Offset of the first of the ndelims delimiters in the n bytes at buf, or
+// n if there is none. map has bit b set for each delimiter b, for the
+// bytes left over by the vector loop.
+size_t delimFind(const uint8_t* buf, size_t n, const uint8_t* delims, int ndelims, const uint8_t* map)
 {
-  serv_socket_state_t * s = (serv_socket_state_t *) malloc (sizeof(serv_socket_state_t));
-  if (strncpy(s->name, name, STR_BUFF_SZ) == NULL) {
-    fprintf(stderr, "ERROR: could not copy the name when creating server state\n");
-    exit(EXIT_FAILURE);
+  if (ndelims <= 0) return n;
+  if (ndelims == 1) {
+    const uint8_t* p = (const uint8_t *) memchr(buf, delims[0], n);
+    return p == NULL ? n : (size_t) (p - buf);
   }
-  s->port = dflt_port;
-  s->sock = -1;
-  s->conn = -1;
-  printf("---- allocated socket for %s\n", s->name);
-  return (unsigned long long) s;
+  size_t i = 0;
+#if defined(__SSE2__)
+  // Every entry the loop reads is set, ndelims being at least 2 here
+  __m128i d[DELIMS_MAX];
+  for (int k = 0; k < ndelims && k < DELIMS_MAX; k++) d[k] = _mm_set1_epi8((char) delims[k]);
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) &buf[i]);
+    __m128i m = _mm_cmpeq_epi8(v, d[0]);
+    for (int k = 1; k < ndelims; k++) m = _mm_or_si128(m, _mm_cmpeq_epi8(v, d[k]));
+    int mask = _mm_movemask_epi8(m);
+    if (mask != 0) return i + __builtin_ctz(mask);
+  }
+#elif defined(__ARM_NEON)
+  // Every entry the loop reads is set, ndelims being at least 2 here
+  uint8x16_t d[DELIMS_MAX];
+  for (int k = 0; k < ndelims && k < DELIMS_MAX; k++) d[k] = vdupq_n_u8(delims[k]);
+  for (; i + 16 <= n; i += 16) {
+    uint8x16_t v = vld1q_u8(&buf[i]);
+    uint8x16_t m = vceqq_u8(v, d[0]);
+    for (int k = 1; k < ndelims; k++) m = vorrq_u8(m, vceqq_u8(v, d[k]));
+    // Narrow to 4 bits per byte to get a mask out
+    uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+    if (mask != 0) return i + (__builtin_ctzll(mask) >> 2);
+  }
+#endif
+  for (; i < n; i++)
+    if (map[buf[i] >> 3] & (1 << (buf[i] & 7))) return i;
+  return n;
 }
 
-void socket_init(unsigned long long ptr, bool server)
+// Shared memory rings
+////////////////////////////////////////////////////////////////////////////////
+
+// Indices of a single-producer single-consumer byte ring. head is only
+// written by the consumer and tail only by the producer; both count bytes
+// modulo 2^32. The waiting flags are raised by a side about to sleep on the
+// other side's index, so that a wakeup is only issued when the peer is idle.
+typedef struct {
+  _Atomic uint32_t head;
+  _Atomic uint32_t head_waiting;
+  char pad0[RING_ALIGN - 2*sizeof(uint32_t)];
+  _Atomic uint32_t tail;
+  _Atomic uint32_t tail_waiting;
+  char pad1[RING_ALIGN - 2*sizeof(uint32_t)];
+} ring_idx_t;
+
+// A ring is its indices plus a power-of-two sized data area. Each side has
+// its own handle on a ring: wake_fd is -1 if the other side sleeps on a
+// futex, or a pipe to write to if it sleeps in poll(2).
+typedef struct {
+  ring_idx_t* idx;
+  uint8_t* data;
+  uint32_t size;
+  int wake_fd;
+} spsc_ring_t;
+
+// Layout of a shared memory transport: this header, then the server to
+// client ring, then the client to server ring
+typedef struct {
+  _Atomic uint32_t magic;
+  uint32_t ring_size;
+  char pad[RING_ALIGN - 2*sizeof(uint32_t)];
+} shm_header_t;
+
+#ifdef __linux__
+void futexWait(_Atomic uint32_t * addr, uint32_t val, int timeout_ms)
 {
-  serv_socket_state_t * s = (serv_socket_state_t *) ptr;
-  if (s->sock != -1) return;
+  struct timespec ts;
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+}
 
-  // Ignore SIGPIPE
-  signal(SIGPIPE, SIG_IGN);
+void futexWake(_Atomic uint32_t * addr)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+#else
+// Without futexes, sleepers poll the index and wakeups are implicit
+void futexWait(_Atomic uint32_t * addr, uint32_t val, int timeout_ms)
+{
+  usleep(100);
+}
 
-  // Create socket
-  s->sock = socket(AF_INET, SOCK_STREAM, 0);
-  if (s->sock == -1) {
-    perror("socket");
-    exit(EXIT_FAILURE);
+void futexWake(_Atomic uint32_t * addr) {}
+#endif
+
+// Wake the peer if it is sleeping on the given index of ring r
+void ringSignal(spsc_ring_t * r, _Atomic uint32_t * index, _Atomic uint32_t * waiting)
+{
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!atomic_load_explicit(waiting, memory_order_relaxed)) return;
+  if (r->wake_fd == -1) futexWake(index);
+  else {
+    uint8_t token = 0;
+    if (write(r->wake_fd, &token, 1) == -1) assert(errno == EAGAIN);
   }
+}
 
-  int opt = 1;
-  if (setsockopt(s->sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
-    perror("setsockopt");
+// Allocate a ring in process memory, of at least sz bytes
+void ringAlloc(spsc_ring_t * r, long sz)
+{
+  for (r->size = RING_ALIGN; r->size < sz && r->size < (1u << 31); r->size <<= 1);
+  if (posix_memalign((void **) &r->idx, RING_ALIGN, sizeof(ring_idx_t)) != 0 ||
+      (r->data = (uint8_t *) malloc (r->size)) == NULL) {
+    logMsg(SOCKET_LOG_ERROR, "could not allocate a %u byte ring", r->size);
     exit(EXIT_FAILURE);
   }
+  memset(r->idx, 0, sizeof(ring_idx_t));
+  r->wake_fd = -1;
+}
 
-  // Bind socket
-  s->port = getPortNumber(s->name, s->port);
-  struct sockaddr_in sockAddr;
-  memset(&sockAddr, 0, sizeof(sockAddr));
-  sockAddr.sin_family = AF_INET;
-  sockAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-  sockAddr.sin_port = htons(s->port);
-  
-  if (server) {
-    int ret = bind(s->sock, (struct sockaddr *) &sockAddr, sizeof(sockAddr));
-    if (ret == -1) {
-      perror("bind");
-      exit(EXIT_FAILURE);
-    }
-
-    // Listen for connections
-    ret = listen(s->sock, 0);
-    if (ret == -1) {
-      perror("listen");
-      exit(EXIT_FAILURE);
-    }
-  } else {
-    int ret = connect(s->sock, (struct sockaddr *) &sockAddr, sizeof(sockAddr));
-    if (ret == -1) {
-      perror("connect");
-      exit(EXIT_FAILURE);
-    }
-  }
+// Bytes ready to be consumed
+uint32_t ringAvailable(spsc_ring_t * r)
+{
+  uint32_t tail = atomic_load_explicit(&r->idx->tail, memory_order_acquire);
+  return tail - atomic_load_explicit(&r->idx->head, memory_order_relaxed);
+}
 
-  // Make it non-blocking
-  socketSetNonBlocking(s->sock);
+// Consume up to nbytes, returning the number copied into buf
+uint32_t ringRead(spsc_ring_t * r, void * buf, uint32_t nbytes)
+{
+  uint32_t head = atomic_load_explicit(&r->idx->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&r->idx->tail, memory_order_acquire);
+  uint32_t n = tail - head;
+  if (n > nbytes) n = nbytes;
+  if (n == 0) return 0;
+  uint32_t off = head & (r->size - 1);
+  uint32_t first = r->size - off < n ? r->size - off : n;
+  memcpy(buf, &r->data[off], first);
+  memcpy((uint8_t *) buf + first, r->data, n - first);
+  atomic_store_explicit(&r->idx->head, head + n, memory_order_release);
+  ringSignal(r, &r->idx->head, &r->idx->head_waiting);
+  return n;
+}
 
-  printf("---- %s socket listening on port %d\n", s->name, s->port);
+// Produce up to nbytes, returning the number copied from buf
+uint32_t ringWrite(spsc_ring_t * r, const void * buf, uint32_t nbytes)
+{
+  uint32_t tail = atomic_load_explicit(&r->idx->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&r->idx->head, memory_order_acquire);
+  uint32_t n = r->size - (tail - head);
+  if (n > nbytes) n = nbytes;
+  if (n == 0) return 0;
+  uint32_t off = tail & (r->size - 1);
+  uint32_t first = r->size - off < n ? r->size - off : n;
+  memcpy(&r->data[off], buf, first);
+  memcpy(r->data, (const uint8_t *) buf + first, n - first);
+  atomic_store_explicit(&r->idx->tail, tail + n, memory_order_release);
+  ringSignal(r, &r->idx->tail, &r->idx->tail_waiting);
+  return n;
 }
 
-// Accept connection
-void acceptConnection(serv_socket_state_t * s, bool server)
+// Sleep until the ring has data (to_write false) or space (to_write true),
+// or until timeout_ms expires if non-negative
+void ringWait(spsc_ring_t * r, bool to_write, int timeout_ms)
 {
-  if (s->conn != -1) return;
-  if (s->sock == -1) socket_init((unsigned long long) s, server);
+  _Atomic uint32_t * index = to_write ? &r->idx->head : &r->idx->tail;
+  _Atomic uint32_t * waiting = to_write ? &r->idx->head_waiting : &r->idx->tail_waiting;
+  uint32_t seen = atomic_load_explicit(index, memory_order_acquire);
+  atomic_store_explicit(waiting, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  bool ready = to_write ? ringAvailable(r) < r->size : ringAvailable(r) > 0;
+  if (!ready && atomic_load_explicit(index, memory_order_relaxed) == seen)
+    futexWait(index, seen, timeout_ms);
+  atomic_store_explicit(waiting, 0, memory_order_relaxed);
+}
 
-  if (server) {
-    // Accept connection
-    s->conn = accept(s->sock, NULL, NULL);
+// Traces
+////////////////////////////////////////////////////////////////////////////////
 
-    // Make connection non-blocking
-    if (s->conn != -1) {
-      printf("---- %s socket got a connection\n", s->name);
-      socketSetNonBlocking(s->conn);
-    }
-  } else s->conn = s->sock;
+// A trace file, as written with <name>_CAPTURE and read with <name>_REPLAY:
+// a trace_header_t then records, each a trace_record_t followed by its
+// payload padded to 8 bytes. Records hold the bytes delivered by a get
+// (TRACE_GET) or accepted by a put (TRACE_PUT) with the index of that call
+// among all the get and put calls of the socket.
+typedef struct {
+  uint64_t magic;
+  uint64_t size; // bytes of records following the header
+} trace_header_t;
+
+typedef struct {
+  uint64_t call;
+  uint32_t nbytes;
+  uint32_t dir;
+} trace_record_t;
+
+// An open trace, mapped in memory. When replaying, rd and wr are the
+// offsets of the next get and put records, and rd_off and wr_off how much
+// of their payloads has been consumed.
+typedef struct {
+  char file[STR_BUFF_SZ];
+  int fd;
+  uint8_t* base;
+  size_t map_sz;
+  size_t rd;
+  size_t rd_off;
+  size_t wr;
+  size_t wr_off;
+  bool diverged;
+  bool ended;
+} socket_trace_t;
+
+size_t traceRecordSize(uint32_t nbytes)
+{
+  return sizeof(trace_record_t) + ((nbytes + 7) & ~(size_t) 7);
 }
 
+trace_header_t* traceHeader(socket_trace_t * t)
+{
+  return (trace_header_t *) t->base;
+}
 
-// Non-blocking read of 8 bits
-uint32_t socket_get8(unsigned long long ptr, bool server)
+// Map the first sz bytes of the trace file, growing the file if writing
+void traceMap(socket_trace_t * t, size_t sz, bool writing)
 {
-  serv_socket_state_t * s = (serv_socket_state_t *) ptr;
-  uint8_t byte;
-  acceptConnection(s, server);
-  if (s->conn == -1) return -1;
-  int n = read(s->conn, &byte, 1);
-  if (n == 1)
-    return (uint32_t) byte;
-  else if (!(n == -1 && errno == EAGAIN)) {
-    close(s->conn);
-    s->conn = -1;
+  if (t->base != NULL) munmap(t->base, t->map_sz);
+  if (writing && ftruncate(t->fd, sz) == -1) {
+    logMsg(SOCKET_LOG_ERROR, "could not grow trace %s: %s", t->file, strerror(errno));
+    exit(EXIT_FAILURE);
   }
-  return -1;
+  t->base = (uint8_t *) mmap(NULL, sz, writing ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, t->fd, 0);
+  if (t->base == MAP_FAILED) {
+    logMsg(SOCKET_LOG_ERROR, "could not map trace %s: %s", t->file, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  t->map_sz = sz;
 }
 
-// Non-blocking write of 8 bits
-uint8_t socket_put8(unsigned long long ptr, uint8_t byte, bool server)
+// Create a trace file to capture into, or open one to replay
+socket_trace_t* traceOpen(const char * file, bool writing)
 {
-  serv_socket_state_t * s = (serv_socket_state_t *) ptr;
-  acceptConnection(s, server);
-  if (s->conn == -1) return 0;
-  int n = write(s->conn, &byte, 1);
-  if (n == 1)
-    return 1;
-  else if (!(n == -1 && errno == EAGAIN)) {
-    close(s->conn);
-    s->conn = -1;
+  socket_trace_t * t = (socket_trace_t *) calloc (1, sizeof(socket_trace_t));
+  if (t == NULL) {
+    logMsg(SOCKET_LOG_ERROR, "could not allocate trace %s", file);
+    exit(EXIT_FAILURE);
   }
-  return 0;
+  strncpy(t->file, file, STR_BUFF_SZ-1);
+  t->fd = writing ? open(file, O_RDWR|O_CREAT|O_TRUNC, 0644) : open(file, O_RDONLY);
+  if (t->fd == -1) {
+    logMsg(SOCKET_LOG_ERROR, "could not open trace %s: %s", file, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (writing) {
+    traceMap(t, TRACE_CHUNK_SZ, true);
+    traceHeader(t)->magic = TRACE_MAGIC;
+    traceHeader(t)->size = 0;
+  } else {
+    struct stat st;
+    if (fstat(t->fd, &st) == -1 || (size_t) st.st_size < sizeof(trace_header_t)) {
+      logMsg(SOCKET_LOG_ERROR, "%s is not a socket trace", file);
+      exit(EXIT_FAILURE);
+    }
+    traceMap(t, st.st_size, false);
+    if (traceHeader(t)->magic != TRACE_MAGIC ||
+        traceHeader(t)->size > st.st_size - sizeof(trace_header_t)) {
+      logMsg(SOCKET_LOG_ERROR, "%s is not a socket trace", file);
+      exit(EXIT_FAILURE);
+    }
+  }
+  t->rd = sizeof(trace_header_t);
+  t->wr = sizeof(trace_header_t);
+  return t;
 }
 
-// Blocking write of 8 bits
-uint8_t socket_put8_blocking(unsigned long long ptr, uint8_t byte, bool server)
+// Close a trace, trimming a captured one to the records written
+void traceClose(socket_trace_t * t, bool writing)
 {
-  serv_socket_state_t * s = (serv_socket_state_t *) ptr;
-  acceptConnection(s, server);
-  if (s->conn == -1) return 0;
-  for (int i = 1; i <= 1000; i++) {
-    int n = write(s->conn, &byte, 1);
-    if (n == 1) return 1;
-    else if (!(n == -1 && errno == EAGAIN)) return 0;
-    usleep(1000000);
-  }
-  perror("Failed to send byte in socket");
-  return 0;
+  size_t sz = sizeof(trace_header_t) + traceHeader(t)->size;
+  munmap(t->base, t->map_sz);
+  if (writing && ftruncate(t->fd, sz) == -1)
+    logMsg(SOCKET_LOG_ERROR, "could not truncate trace %s: %s", t->file, strerror(errno));
+  close(t->fd);
+  free(t);
 }
 
-
-// Try to read N bytes from socket, giving N+1 byte result. Bottom N
-// bytes contain data and MSB is 0 if data is valid or non-zero if no
-// data is available.  Non-blocking on N-byte boundaries.
-void socket_getN(void* result, unsigned long long ptr, int nbytes, bool server)
+// Append a record of nbytes at data to a captured trace
+void traceAppend(socket_trace_t * t, uint64_t call, uint32_t dir, const void * data, size_t nbytes)
 {
-  serv_socket_state_t * s = (serv_socket_state_t *) ptr;
-  uint8_t* bytes = (uint8_t*) result;
-  acceptConnection(s, server);
-  if (s->conn == -1) {
-    bytes[nbytes] = 0xff;
-    return;
-  }
-  int count = read(s->conn, bytes, nbytes);
-  if (count == nbytes) {
-    bytes[nbytes] = 0;
-    return;
-  }
-  else if (count > 0) {
-    // Use blocking reads to get remaining data
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(s->conn, &fds);
-    while (count < nbytes) {
-      int res = select(s->conn+1, &fds, NULL, NULL, NULL);
-      assert(res >= 0);
-      res = read(s->conn, &bytes[count], nbytes-count);
-      assert(res >= 0);
-      count += res;
-    }
-    bytes[nbytes] = 0;
-    return;
+  trace_header_t * h = traceHeader(t);
+  size_t end = sizeof(trace_header_t) + h->size;
+  size_t rec_sz = traceRecordSize(nbytes);
+  if (end + rec_sz > t->map_sz) {
+    size_t sz = t->map_sz;
+    while (end + rec_sz > sz) sz += TRACE_CHUNK_SZ;
+    traceMap(t, sz, true);
+    h = traceHeader(t);
   }
-  else {
-    bytes[nbytes] = 0xff;
-    if (!(count == -1 && errno == EAGAIN)) {
-      close(s->conn);
-      s->conn = -1;
-    }
-    return;
+  trace_record_t * r = (trace_record_t *) &t->base[end];
+  r->call = call;
+  r->nbytes = nbytes;
+  r->dir = dir;
+  memcpy(&t->base[end + sizeof(trace_record_t)], data, nbytes);
+  h->size += rec_sz;
+}
+
+// Find the record of direction dir at or after offset off of a replayed
+// trace, moving off to it. Returns NULL at the end of the trace.
+trace_record_t* traceNext(socket_trace_t * t, size_t * off, uint32_t dir)
+{
+  size_t end = sizeof(trace_header_t) + traceHeader(t)->size;
+  while (*off + sizeof(trace_record_t) <= end) {
+    trace_record_t * r = (trace_record_t *) &t->base[*off];
+    if (*off + traceRecordSize(r->nbytes) > end) break;
+    if (r->dir == dir) return r;
+    *off += traceRecordSize(r->nbytes);
   }
+  return NULL;
 }
 
-// Try to write N bytes to socket.  Non-blocking on N-bytes boundaries,
-// returning 0 when no write performed.
-uint8_t socket_putN(unsigned long long ptr, int nbytes, unsigned int* data, bool server)
+// Read up to nbytes of the get records due by call index call, returning
+// like read(2) with EAGAIN when none are due
+int traceRead(socket_trace_t * t, uint64_t call, void * buf, size_t nbytes)
 {
-  serv_socket_state_t * s = (serv_socket_state_t *) ptr;
-  acceptConnection(s, server);
-  if (s->conn == -1) return 0;
-  uint8_t* bytes = (uint8_t*) data;
-  int count = write(s->conn, bytes, nbytes);
-  if (count == nbytes)
-    return 1;
-  else if (count > 0) {
-    // Use blocking writes to put remaining data
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(s->conn, &fds);
-    while (count < nbytes) {
-      int res = select(s->conn+1, NULL, &fds, NULL, NULL);
-      assert(res >= 0);
-      res = write(s->conn, &bytes[count], nbytes-count);
-      assert(res >= 0);
-      count += res;
+  uint8_t * bytes = (uint8_t *) buf;
+  size_t done = 0;
+  trace_record_t * r;
+  while (done < nbytes && (r = traceNext(t, &t->rd, TRACE_GET)) != NULL && r->call <= call) {
+    size_t n = r->nbytes - t->rd_off;
+    if (n > nbytes - done) n = nbytes - done;
+    memcpy(&bytes[done], (uint8_t *) (r + 1) + t->rd_off, n);
+    done += n;
+    t->rd_off += n;
+    if (t->rd_off == r->nbytes) {
+      t->rd += traceRecordSize(r->nbytes);
+      t->rd_off = 0;
     }
-    return 1;
   }
-  else {
-    if (!(count == -1 && errno == EAGAIN)) {
-      close(s->conn);
-      s->conn = -1;
+  if (done > 0) return done;
+  errno = EAGAIN;
+  return -1;
+}
+
+// Compare nbytes written during replay with the put records of the trace,
+// returning false on the first difference
+bool traceCheck(socket_trace_t * t, const void * buf, size_t nbytes)
+{
+  const uint8_t * bytes = (const uint8_t *) buf;
+  size_t done = 0;
+  while (done < nbytes) {
+    trace_record_t * r = traceNext(t, &t->wr, TRACE_PUT);
+    if (r == NULL) return false;
+    size_t n = r->nbytes - t->wr_off;
+    if (n > nbytes - done) n = nbytes - done;
+    if (memcmp(&bytes[done], (uint8_t *) (r + 1) + t->wr_off, n) != 0) return false;
+    done += n;
+    t->wr_off += n;
+    if (t->wr_off == r->nbytes) {
+      t->wr += traceRecordSize(r->nbytes);
+      t->wr_off = 0;
     }
-    return 0;
   }
+  return true;
 }
 
-// serv_socket API implementation
+// Latency histograms
 ////////////////////////////////////////////////////////////////////////////////
-unsigned long long serv_socket_create(const char * name, unsigned int dflt_port)
+
+// Log-linear histogram in the style of HdrHistogram: values below
+// LAT_SUB_BKTS get a bucket each, and every power of two above is split in
+// LAT_SUB_BKTS buckets, so any value is known to within 1/LAT_SUB_BKTS.
+typedef struct {
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  uint64_t sum;
+  uint64_t bkts[LAT_BKTS];
+} lat_hist_t;
+
+// When a byte range was read or accepted: up to end in the count of bytes
+// that went through, at time ns and simulation cycle cycle
+typedef struct {
+  uint64_t end;
+  uint64_t ns;
+  uint64_t cycle;
+} lat_mark_t;
+
+// Marks still to account for, oldest at head
+typedef struct {
+  lat_mark_t marks[LAT_MARKS];
+  uint32_t head;
+  uint32_t n;
+  uint64_t bytes; // bytes read, or accepted by puts, so far
+} lat_marks_t;
+
+// Per-socket latency accounting, enabled with <name>_LATENCY: from the
+// read bringing a packet in to the get delivering it, and from the put
+// accepting a packet to the write sending it, in ns and, once the caller
+// supplies the simulation cycle, in cycles. Packets rxGet takes straight
+// out of a ring are timed from the get that first found them there,
+// ring_seen bytes of the ring having been marked that way.
+typedef struct {
+  lat_hist_t hist[4];
+  lat_marks_t rx;
+  lat_marks_t tx;
+  uint64_t ring_seen;
+  uint64_t cycle;
+  bool cycles;
+} socket_latency_t;
+
+uint32_t latBucket(uint64_t v)
 {
-  return socket_create(name, dflt_port);
+  if (v < LAT_SUB_BKTS) return (uint32_t) v;
+  int m = 63 - __builtin_clzll(v);
+  return (m - LAT_SUB_BITS + 1) * LAT_SUB_BKTS + ((v >> (m - LAT_SUB_BITS)) & (LAT_SUB_BKTS - 1));
 }
 
-// A wrapper for systems that don't allow passing strings (verilator?)
-unsigned long long serv_socket_create_nameless(unsigned int dflt_port)
+// Highest value falling in bucket b
+uint64_t latBucketValue(uint32_t b)
 {
-  char* s = getenv(ENV_DFLT_SOCKET_NAME);
-  if (s != NULL) return serv_socket_create(s, dflt_port);
-  else {
-    printf("---- " ENV_DFLT_SOCKET_NAME " environment variable not defined");
-    printf(", using default socket name %s instead\n", DFLT_SOCKET_NAME);
-    return serv_socket_create(DFLT_SOCKET_NAME, dflt_port);
-  }
+  if (b < LAT_SUB_BKTS) return b;
+  int shift = b / LAT_SUB_BKTS - 1;
+  return ((uint64_t) (LAT_SUB_BKTS + b % LAT_SUB_BKTS) << shift) + ((1ull << shift) - 1);
 }
 
-// Open, bind and listen
-extern void serv_socket_init(unsigned long long ptr)
+void latRecord(lat_hist_t * h, uint64_t v)
 {
-  socket_init(ptr, true);
+  if (h->count == 0 || v < h->min) h->min = v;
+  if (v > h->max) h->max = v;
+  h->count++;
+  h->sum += v;
+  h->bkts[latBucket(v)]++;
 }
 
-// Non-blocking read of 8 bits
-uint32_t serv_socket_get8(unsigned long long ptr)
+// Smallest value that a fraction p of the samples does not exceed
+uint64_t latPercentile(lat_hist_t * h, double p)
 {
-  return socket_get8(ptr, true);
+  uint64_t rank = (uint64_t) (p * h->count + 0.5);
+  if (rank < 1) rank = 1;
+  uint64_t seen = 0;
+  for (uint32_t b = 0; b < LAT_BKTS; b++) {
+    seen += h->bkts[b];
+    if (seen >= rank) return latBucketValue(b) < h->max ? latBucketValue(b) : h->max;
+  }
+  return h->max;
 }
 
-// Non-blocking write of 8 bits
-uint8_t serv_socket_put8(unsigned long long ptr, uint8_t byte)
+void latSummary(lat_hist_t * h, socket_latency_stats_t * st)
 {
-  return socket_put8(ptr, byte, true);
+  memset(st, 0, sizeof(*st));
+  if (h->count == 0) return;
+  st->count = h->count;
+  st->min = h->min;
+  st->mean = h->sum / h->count;
+  st->p50 = latPercentile(h, 0.5);
+  st->p90 = latPercentile(h, 0.9);
+  st->p99 = latPercentile(h, 0.99);
+  st->p999 = latPercentile(h, 0.999);
+  st->max = h->max;
 }
 
-// Blocking write of 8 bits
-uint8_t serv_socket_put8_blocking(unsigned long long ptr, uint8_t byte)
+// Note that nbytes more went through at the current time, merging with
+// the latest mark when out of room
+void latMark(socket_latency_t * l, lat_marks_t * m, size_t nbytes)
 {
-  return socket_put8_blocking(ptr, byte, true);
+  m->bytes += nbytes;
+  if (m->n == LAT_MARKS) {
+    m->marks[(m->head + m->n - 1) % LAT_MARKS].end = m->bytes;
+    return;
+  }
+  lat_mark_t * k = &m->marks[(m->head + m->n++) % LAT_MARKS];
+  k->end = m->bytes;
+  k->ns = monotonicNs();
+  k->cycle = l->cycle;
 }
 
+void latSample(socket_latency_t * l, lat_mark_t * k, int hist)
+{
+  latRecord(&l->hist[hist], monotonicNs() - k->ns);
+  if (l->cycles) latRecord(&l->hist[hist + 2], l->cycle - k->cycle);
+}
 
-// Try to read N bytes from socket, giving N+1 byte result. Bottom N
-// bytes contain data and MSB is 0 if data is valid or non-zero if no
-// data is available.  Non-blocking on N-byte boundaries.
-void serv_socket_getN(void* result, unsigned long long ptr, int nbytes)
+// A get delivered data, pos bytes having been consumed from the receive
+// buffer so far: record the time since the read of the last byte
+// delivered, forgetting about the reads before it
+void latRx(socket_latency_t * l, uint64_t pos)
 {
-  socket_getN(result, ptr, nbytes, true);
+  lat_marks_t * m = &l->rx;
+  while (m->n > 0 && m->marks[m->head].end < pos) {
+    m->head = (m->head + 1) % LAT_MARKS;
+    m->n--;
+  }
+  if (m->n > 0) latSample(l, &m->marks[m->head], 0);
 }
 
-// Try to write N bytes to socket.  Non-blocking on N-bytes boundaries,
-// returning 0 when no write performed.
-uint8_t serv_socket_putN(unsigned long long ptr, int nbytes, unsigned int* data)
+// pos bytes accepted by puts have been written out so far: record the
+// time since each of the puts completed by it
+void latTx(socket_latency_t * l, uint64_t pos)
 {
-  return socket_putN(ptr, nbytes, data, true);
+  lat_marks_t * m = &l->tx;
+  while (m->n > 0 && m->marks[m->head].end <= pos) {
+    latSample(l, &m->marks[m->head], 1);
+    m->head = (m->head + 1) % LAT_MARKS;
+    m->n--;
+  }
 }
 
-// client_socket API implementation
+// A client connection of a server in multi-client mode
+typedef struct {
+  // -1 once the client has closed its end, the client being kept until
+  // what it sent has been merged
+  int fd;
+  // Received bytes not merged into the server's receive buffer yet
+  uint8_t* rx_buf;
+  size_t rx_cap;
+  size_t rx_head;
+  size_t rx_tail;
+  // Set while only part of a record longer than the reader's maximum has
+  // been merged, the rest of it then being merged before anything else
+  bool rx_piece;
+  // Offset in the shared transmit buffer up to which this client has been
+  // sent the output
+  size_t tx_off;
+} socket_client_t;
+
+// An address a client may reach its server at
+typedef struct {
+  struct sockaddr_storage addr;
+  socklen_t len;
+} socket_peer_t;
+
+// state for a server
+typedef struct serv_socket_state {
+  int sock;
+  int conn;
+  // Receive buffer, filled by large non-blocking reads and drained by the
+  // get functions. Bytes pending delivery are rx_buf[rx_head..rx_tail).
+  uint8_t* rx_buf;
+  size_t rx_cap;
+  size_t rx_head;
+  size_t rx_tail;
+  // Transmit buffer, holding bytes pending transmission in
+  // tx_buf[tx_head..tx_tail). These are the unwritten rest of a packet the
+  // connection only partly accepted, or, when write combining is enabled by
+  // setting <name>_TX_COMBINE to the buffer size in bytes, bytes waiting
+  // for the buffer to fill, for tx_flush_calls calls into the socket (if
+  // non-zero), or for an explicit flush.
+  uint8_t* tx_buf;
+  size_t tx_cap;
+  size_t tx_head;
+  size_t tx_tail;
+  bool tx_combine;
+  int tx_flush_calls;
+  int tx_calls;
+  // Overall time limit of a blocking write, from <name>_PUT_TIMEOUT_MS
+  int put_timeout_ms;
+  // Adaptive backoff of idle polls: after BACKOFF_IDLE_POLLS empty polls
+  // in a row, only every backoff-th get checks the kernel, doubling up to
+  // backoff_max (<name>_BACKOFF_MAX, 1 to disable) while nothing arrives
+  int backoff_max;
+  int backoff;
+  int backoff_skip;
+  int idle_polls;
+  // Multi-client mode, enabled on servers by setting <name>_MAX_CLIENTS
+  // above 1, with conn holding the first client's file descriptor. All
+  // output goes to every client: the transmit buffer is shared (its size
+  // is <name>_FANOUT_SIZE unless write combining sets it) and bytes stay in
+  // it until sent to all clients, a client that falls a whole buffer behind
+  // the others being dropped rather than stalling them. Input is merged
+  // round robin, a packet of rx_unit bytes (the size being read) at a time,
+  // from per-client receive buffers. Messages and delimited records are
+  // merged whole, records of up to rx_record bytes (the most being read).
+  socket_client_t* clients;
+  int max_clients;
+  int nclients;
+  int rx_next;
+  size_t rx_unit; // 0 when reading length-prefixed messages or records
+  size_t rx_record; // 0 unless reading records
+  int accept_calls;
+  // Length-prefixed messages: bytes left to discard of a message too long
+  // for the reader, and a buffer to assemble outgoing messages in
+  size_t rx_skip;
+  uint8_t* msg_buf;
+  size_t msg_cap;
+  // Shared memory transport, used instead of a socket when <name>_SHM
+  // names a shared memory object. conn then holds the object's fd.
+  void* shm;
+  size_t shm_sz;
+  spsc_ring_t ring_rx;
+  spsc_ring_t ring_tx;
+  // Poll set this socket was added to, if any. The get functions then only
+  // look for connections or data when the last poll reported it ready.
+  struct socket_poll_set* poll_set;
+  bool poll_ready;
+  // Background I/O thread, used when <name>_IO_THREAD is non-zero. The
+  // simulator side then only moves data through ring_rx and ring_tx; sock
+  // and conn hold the ends of the pipe used to wake the thread, conn being
+  // -1 until the thread reports a connection.
+  struct io_thread* io;
+  // Set on the private state through which the I/O thread does the actual
+  // socket work
+  bool io_worker;
+  // io_uring backend state, when <name>_IO_URING is set
+  struct socket_uring* ur;
+  // Lock held by every API call in thread-safe mode (<name>_THREAD_SAFE),
+  // NULL otherwise
+  pthread_mutex_t* lock;
+  // Hot path counters, and whether to print them at exit (<name>_STATS).
+  // rx_partial notes that a get found only part of a packet.
+  socket_packet_stats_t stats;
+  bool stats_dump;
+  bool rx_partial;
+  // Number of get and put calls made so far, and the traffic capture
+  // (<name>_CAPTURE) and replay (<name>_REPLAY) traces indexed by it,
+  // which every get and put checks for. A replayed trace is used instead
+  // of a socket, with conn holding its fd.
+  uint64_t calls;
+  socket_trace_t* capture;
+  socket_trace_t* replay;
+  // Latency histograms, if enabled by <name>_LATENCY
+  socket_latency_t* lat;
+  // Cold state and configuration, kept apart from the fields above that
+  // every call touches (see HOT_STATE_SZ). handle is the one socket_create
+  // returned for this state, generation the number of times the state has
+  // been reused.
+  unsigned long long handle;
+  uint32_t generation;
+  bool in_use;
+  size_t next_free;
+  // Delimiter-framed records: the delimiters from <name>_DELIMS, also as a
+  // bitmap, and the number of bytes following a delimiter that still
+  // belong to its record (<name>_DELIM_TRAILER). rx_scan bytes from
+  // rx_head are known not to hold a delimiter, as long as neither rx_head,
+  // the get call count nor the connection count moved since.
+  uint8_t delims[DELIMS_MAX];
+  int ndelims;
+  uint8_t delim_map[32];
+  size_t delim_trailer;
+  size_t rx_scan;
+  size_t rx_scan_head;
+  uint64_t rx_scan_calls;
+  uint64_t rx_scan_conns;
+  // Bulk transfer being received: bulk_got of bulk_size bytes have arrived
+  // in bulk_data, which maps the sent file itself when bulk_mapped
+  bool bulk_active;
+  bool bulk_mapped;
+  uint8_t* bulk_data;
+  uint64_t bulk_size;
+  uint64_t bulk_got;
+  // Shared memory object used, for the server to remove
+  char shm_obj[STR_BUFF_SZ+1];
+  char name[STR_BUFF_SZ];
+  // Unix domain socket path, empty when using TCP on port
+  char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+  int port;
+  // Socket options applied to the listening and connected sockets, from
+  // the <name>_TCP_PROFILE preset and individual overrides, -1 leaving the
+  // system default
+  int tcp_nodelay;
+  int tcp_quickack;
+  int busy_poll_us;
+  int sndbuf;
+  int rcvbuf;
+  // Client connection to peer_addr, made without blocking: connecting
+  // while a connect started at connect_ns is in progress, for up to
+  // connect_timeout_ms (<name>_CONNECT_TIMEOUT_MS). After a failure or a
+  // lost connection sock is -1 until the next attempt at reconnect_ns,
+  // the delay doubling from <name>_RECONNECT_MS up to
+  // <name>_RECONNECT_MAX_MS. peer_len is 0 on other states. peer_addr
+  // is one of the npeers addresses the peer resolved to, the next one
+  // being tried straight away after a failure, peer_tries of them having
+  // failed since the last back-off.
+  struct sockaddr_storage peer_addr;
+  socklen_t peer_len;
+  socket_peer_t* peers;
+  int npeers;
+  int peer_idx;
+  int peer_tries;
+  bool connecting;
+  uint64_t connect_ns;
+  int connect_timeout_ms;
+  uint64_t reconnect_ns;
+  int reconnect_ms;
+  int reconnect_min_ms;
+  int reconnect_max_ms;
+} serv_socket_state_t;
+
+// The fields every get and put touch fit the first HOT_STATE_SZ bytes,
+// trace pointers included
+_Static_assert(offsetof(serv_socket_state_t, handle) <= HOT_STATE_SZ,
+               "hot socket state spills past HOT_STATE_SZ");
+_Static_assert(offsetof(serv_socket_state_t, capture) + sizeof(socket_trace_t *) <= HOT_STATE_SZ &&
+               offsetof(serv_socket_state_t, replay) + sizeof(socket_trace_t *) <= HOT_STATE_SZ,
+               "trace pointers spill past HOT_STATE_SZ");
+
+// Handle registry
 ////////////////////////////////////////////////////////////////////////////////
-unsigned long long client_socket_create(const char * name, unsigned int dflt_port)
+
+// States live in chunks of REGISTRY_CHUNK_SZ, allocated as they are
+// needed, each state starting on its own cache line so that sockets used
+// from different threads do not share lines. A handle is a state's index
+// in the registry plus one, 0 never being valid, tagged with the state's
+// generation, and states never move once created. Destroyed states are
+// cleared, their generation bumped so that handles to them are rejected
+// rather than reaching whichever socket reuses them, and kept on a free
+// list, for the next socket created to reuse. Sockets are created and destroyed
+// holding socket_registry_lock, so that different threads can do so, and
+// socket_count only grows once its new state is ready.
+uint8_t* socket_chunks[REGISTRY_MAX_CHUNKS];
+_Atomic size_t socket_count = 0;
+size_t socket_free = 0; // index plus one of the first free state, if any
+pthread_mutex_t socket_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// State at index i of the registry
+serv_socket_state_t * socketSlot(size_t i)
 {
-  return socket_create(name, dflt_port);
+  return (serv_socket_state_t *) &socket_chunks[i / REGISTRY_CHUNK_SZ][(i % REGISTRY_CHUNK_SZ) * STATE_STRIDE];
 }
 
-// Open, bind and listen
-extern void client_socket_init(unsigned long long ptr)
+// State of a handle
+serv_socket_state_t * socketState(unsigned long long handle)
 {
-  socket_init(ptr, false);
+  size_t i = HANDLE_INDEX(handle);
+  if (i == 0 || i > socket_count || !socketSlot(i - 1)->in_use) {
+    logMsg(SOCKET_LOG_ERROR, "invalid socket handle %llu", handle);
+    exit(EXIT_FAILURE);
+  }
+  serv_socket_state_t * s = socketSlot(i - 1);
+  if (HANDLE_GEN(handle) != s->generation) {
+    logMsg(SOCKET_LOG_ERROR, "stale socket handle %llu, its socket was destroyed", handle);
+    exit(EXIT_FAILURE);
+  }
+  return s;
 }
 
-// Try to read N bytes from socket, giving N+1 byte result. Bottom N
-// bytes contain data and MSB is 0 if data is valid or non-zero if no
-// data is available.  Non-blocking on N-byte boundaries.
-void client_socket_getN(void* result, unsigned long long ptr, int nbytes)
+// Allocate a state, returning it with its handle set
+serv_socket_state_t * socketAlloc(void)
 {
-  socket_getN(result, ptr, nbytes, false);
+  pthread_mutex_lock(&socket_registry_lock);
+  if (socket_free != 0) {
+    serv_socket_state_t * s = socketSlot(socket_free - 1);
+    socket_free = s->next_free;
+    s->next_free = 0;
+    s->handle = ((unsigned long long) s->generation << 32) | HANDLE_INDEX(s->handle);
+    s->in_use = true;
+    pthread_mutex_unlock(&socket_registry_lock);
+    return s;
+  }
+  size_t i = socket_count;
+  if (i == (size_t) REGISTRY_CHUNK_SZ * REGISTRY_MAX_CHUNKS) {
+    logMsg(SOCKET_LOG_ERROR, "too many sockets");
+    exit(EXIT_FAILURE);
+  }
+  if (i % REGISTRY_CHUNK_SZ == 0) {
+    void* chunk;
+    if (posix_memalign(&chunk, RING_ALIGN, REGISTRY_CHUNK_SZ * STATE_STRIDE) != 0) {
+      logMsg(SOCKET_LOG_ERROR, "could not allocate socket states");
+      exit(EXIT_FAILURE);
+    }
+    memset(chunk, 0, REGISTRY_CHUNK_SZ * STATE_STRIDE);
+    socket_chunks[i / REGISTRY_CHUNK_SZ] = (uint8_t *) chunk;
+  }
+  serv_socket_state_t * s = socketSlot(i);
+  s->handle = i + 1;
+  s->in_use = true;
+  socket_count++;
+  pthread_mutex_unlock(&socket_registry_lock);
+  return s;
 }
 
-// Try to write N bytes to socket.  Non-blocking on N-bytes boundaries,
-// returning 0 when no write performed.
-uint8_t client_socket_putN(unsigned long long ptr, int nbytes, unsigned int* data)
+// Return a state to the registry
+void socketRelease(serv_socket_state_t * s)
+{
+  pthread_mutex_lock(&socket_registry_lock);
+  unsigned long long handle = s->handle;
+  uint32_t generation = s->generation;
+  memset(s, 0, sizeof(serv_socket_state_t));
+  s->handle = handle;
+  s->generation = generation + 1;
+  s->next_free = socket_free;
+  socket_free = HANDLE_INDEX(handle);
+  pthread_mutex_unlock(&socket_registry_lock);
+}
+
+// Look up the state of a handle, taking its lock in thread-safe mode
+serv_socket_state_t * socketLock(unsigned long long handle)
+{
+  serv_socket_state_t * s = socketState(handle);
+  if (s->lock != NULL) pthread_mutex_lock(s->lock);
+  return s;
+}
+
+void socketUnlock(serv_socket_state_t * s)
+{
+  if (s->lock != NULL) pthread_mutex_unlock(s->lock);
+}
+
+// Have fn run at exit, registering it only once whichever thread gets
+// here first
+void atexitOnce(bool * registered, void (*fn)(void))
+{
+  pthread_mutex_lock(&socket_registry_lock);
+  if (!*registered) atexit(fn);
+  *registered = true;
+  pthread_mutex_unlock(&socket_registry_lock);
+}
+
+// Poll the kernel on every get again
+void backoffReset(serv_socket_state_t * s)
+{
+  s->backoff = 1;
+  s->backoff_skip = 0;
+  s->idle_polls = 0;
+}
+
+// Account for a get delivering nbytes at data, or finding no data if 0
+void statGet(serv_socket_state_t * s, const void * data, size_t nbytes)
+{
+  if (nbytes == 0) s->stats.empty_reads++;
+  else {
+    s->stats.reads++;
+    s->stats.bytes_in += nbytes;
+    if (s->capture != NULL) traceAppend(s->capture, s->calls, TRACE_GET, data, nbytes);
+  }
+  s->calls++;
+}
+
+// Account for a put accepting nbytes at data, or refusing data if 0
+void statPut(serv_socket_state_t * s, const void * data, size_t nbytes)
+{
+  if (nbytes == 0) s->stats.full_writes++;
+  else {
+    s->stats.writes++;
+    s->stats.bytes_out += nbytes;
+    if (s->capture != NULL) traceAppend(s->capture, s->calls, TRACE_PUT, data, nbytes);
+    if (s->lat != NULL) {
+      latMark(s->lat, &s->lat->tx, nbytes);
+      latTx(s->lat, s->lat->tx.bytes - (s->tx_tail - s->tx_head));
+    }
+    // A reply is likely due, so stop backing off
+    backoffReset(s);
+  }
+  s->calls++;
+}
+
+// Print the counters of a socket
+void statDump(serv_socket_state_t * s)
+{
+  socket_packet_stats_t * st = &s->stats;
+  logMsg(SOCKET_LOG_INFO, "%s stats: reads %llu, empty reads %llu, writes %llu, full writes %llu, "
+         "bytes in %llu, bytes out %llu, partial reads %llu, partial writes %llu, "
+         "read calls %llu, write calls %llu, blocked %llu ns, connections %llu",
+         s->name, (unsigned long long) st->reads, (unsigned long long) st->empty_reads,
+         (unsigned long long) st->writes, (unsigned long long) st->full_writes,
+         (unsigned long long) st->bytes_in, (unsigned long long) st->bytes_out,
+         (unsigned long long) st->partial_reads, (unsigned long long) st->partial_writes,
+         (unsigned long long) st->read_calls, (unsigned long long) st->write_calls,
+         (unsigned long long) st->blocked_ns, (unsigned long long) st->connections);
+  const char * names[4] = {"rx", "tx", "rx cycles", "tx cycles"};
+  for (int i = 0; s->lat != NULL && i < 4; i++) {
+    socket_latency_stats_t l;
+    latSummary(&s->lat->hist[i], &l);
+    if (l.count == 0) continue;
+    logMsg(SOCKET_LOG_INFO, "%s %s latency%s: count %llu, min %llu, mean %llu, p50 %llu, p90 %llu, "
+           "p99 %llu, p99.9 %llu, max %llu", s->name, names[i], i < 2 ? " ns" : "",
+           (unsigned long long) l.count, (unsigned long long) l.min, (unsigned long long) l.mean,
+           (unsigned long long) l.p50, (unsigned long long) l.p90, (unsigned long long) l.p99,
+           (unsigned long long) l.p999, (unsigned long long) l.max);
+  }
+}
+
+// Print the counters of the sockets that asked for it, at exit
+void statDumpAll(void)
+{
+  for (size_t i = 0; i < socket_count; i++)
+    if (socketSlot(i)->stats_dump) statDump(socketSlot(i));
+}
+
+// Trim the capture files of all sockets to the records written, at exit
+bool traces_atexit = false;
+void traceCloseAll(void)
+{
+  for (size_t i = 0; i < socket_count; i++) {
+    serv_socket_state_t * s = socketSlot(i);
+    if (s->capture != NULL) {
+      traceClose(s->capture, true);
+      s->capture = NULL;
+    }
+  }
+}
+
+// An I/O thread, operating the socket through its own worker state and
+// its own handles on the rings shared with the simulator thread
+typedef struct io_thread {
+  pthread_t tid;
+  serv_socket_state_t* worker;
+  bool server;
+  spsc_ring_t ring_rx;
+  spsc_ring_t ring_tx;
+  int wake[2];
+  _Atomic bool connected;
+  _Atomic bool stop;
+} io_thread_t;
+
+// Whether the connection is a ring rather than a socket file descriptor
+bool ringTransport(serv_socket_state_t * s)
+{
+  return s->ring_rx.data != NULL;
+}
+
+// A set of sockets whose readiness is checked with a single system call
+typedef struct socket_poll_set {
+  int n;
+  serv_socket_state_t* states[POLL_SET_MAX];
+#ifdef __linux__
+  int epfd;
+#endif
+} socket_poll_set_t;
+
+// Create a state, or the private state of an I/O thread if worker, which
+// is not logged as the socket is already
+unsigned long long socketCreate(const char * name, unsigned int dflt_port, bool worker)
+{
+  serv_socket_state_t * s = socketAlloc();
+  if (strncpy(s->name, name, STR_BUFF_SZ) == NULL) {
+    logMsg(SOCKET_LOG_ERROR, "could not copy the name when creating server state");
+    exit(EXIT_FAILURE);
+  }
+  s->path[0] = '\0';
+  s->shm_obj[0] = '\0';
+  s->port = dflt_port;
+  s->sock = -1;
+  s->conn = -1;
+  s->tcp_nodelay = -1;
+  s->tcp_quickack = -1;
+  s->busy_poll_us = -1;
+  s->sndbuf = -1;
+  s->rcvbuf = -1;
+  s->rx_buf = (uint8_t *) malloc (RX_BUFF_SZ);
+  if (s->rx_buf == NULL) {
+    logMsg(SOCKET_LOG_ERROR, "could not allocate the receive buffer for %s", s->name);
+    exit(EXIT_FAILURE);
+  }
+  s->rx_cap = RX_BUFF_SZ;
+  s->rx_head = 0;
+  s->rx_tail = 0;
+  s->tx_buf = NULL;
+  s->tx_cap = 0;
+  s->tx_head = 0;
+  s->tx_tail = 0;
+  s->tx_combine = false;
+  s->tx_flush_calls = 0;
+  s->tx_calls = 0;
+  s->put_timeout_ms = DFLT_PUT_TIMEOUT_MS;
+  s->peer_len = 0;
+  s->peers = NULL;
+  s->npeers = 0;
+  s->peer_idx = 0;
+  s->peer_tries = 0;
+  s->connecting = false;
+  s->connect_ns = 0;
+  s->connect_timeout_ms = DFLT_CONNECT_TIMEOUT_MS;
+  s->reconnect_ns = 0;
+  s->reconnect_ms = DFLT_RECONNECT_MS;
+  s->reconnect_min_ms = DFLT_RECONNECT_MS;
+  s->reconnect_max_ms = DFLT_RECONNECT_MAX_MS;
+  s->backoff_max = DFLT_BACKOFF_MAX;
+  s->backoff = 1;
+  s->backoff_skip = 0;
+  s->idle_polls = 0;
+  s->clients = NULL;
+  s->max_clients = 1;
+  s->nclients = 0;
+  s->rx_next = 0;
+  s->rx_unit = 1;
+  s->rx_record = 0;
+  s->accept_calls = 0;
+  s->rx_skip = 0;
+  s->msg_buf = NULL;
+  s->msg_cap = 0;
+  s->bulk_active = false;
+  s->bulk_mapped = false;
+  s->bulk_data = NULL;
+  s->bulk_size = 0;
+  s->bulk_got = 0;
+  s->capture = NULL;
+  s->replay = NULL;
+  s->calls = 0;
+  s->shm = NULL;
+  s->shm_sz = 0;
+  memset(&s->ring_rx, 0, sizeof(s->ring_rx));
+  memset(&s->ring_tx, 0, sizeof(s->ring_tx));
+  s->poll_set = NULL;
+  s->poll_ready = true;
+  s->io = NULL;
+  s->io_worker = worker;
+  memset(&s->stats, 0, sizeof(s->stats));
+  s->stats_dump = false;
+  s->rx_partial = false;
+  s->lat = NULL;
+  s->ur = NULL;
+  s->lock = NULL;
+  if (getSocketEnvInt(s->name, "THREAD_SAFE", 0) != 0) {
+    s->lock = (pthread_mutex_t *) malloc (sizeof(pthread_mutex_t));
+    if (s->lock == NULL || pthread_mutex_init(s->lock, NULL) != 0) {
+      logMsg(SOCKET_LOG_ERROR, "could not create the lock of %s", s->name);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (!worker) logMsg(SOCKET_LOG_INFO, "allocated socket for %s", s->name);
+  return s->handle;
+}
+
+unsigned long long socket_create(const char * name, unsigned int dflt_port)
+{
+  return socketCreate(name, dflt_port, false);
+}
+
+// Create (server) or attach to (client) the shared memory transport
+void shmInit(serv_socket_state_t * s, const char * shm_name, bool server)
+{
+  char obj_name[STR_BUFF_SZ+1];
+  snprintf(obj_name, sizeof(obj_name), "%s%s", shm_name[0] == '/' ? "" : "/", shm_name);
+  int fd;
+  uint32_t ring_sz;
+  if (server) {
+    long sz = getSocketEnvInt(s->name, "SHM_SIZE", DFLT_SHM_RING_SZ);
+    for (ring_sz = RING_ALIGN; ring_sz < sz && ring_sz < (1u << 31); ring_sz <<= 1);
+    s->shm_sz = sizeof(shm_header_t) + 2 * (sizeof(ring_idx_t) + ring_sz);
+    shm_unlink(obj_name);
+    fd = shm_open(obj_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+      logMsg(SOCKET_LOG_ERROR, "could not create shared memory object %s: %s", obj_name, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    strcpy(s->shm_obj, obj_name);
+    if (ftruncate(fd, s->shm_sz) == -1) {
+      logMsg(SOCKET_LOG_ERROR, "could not size shared memory object %s: %s", obj_name, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    fd = shm_open(obj_name, O_RDWR, 0);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+      logMsg(SOCKET_LOG_ERROR, "could not open shared memory object %s: %s", obj_name, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    s->shm_sz = st.st_size;
+  }
+  s->shm = mmap(NULL, s->shm_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (s->shm == MAP_FAILED) {
+    logMsg(SOCKET_LOG_ERROR, "could not map shared memory object %s: %s", obj_name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  shm_header_t * hdr = (shm_header_t *) s->shm;
+  if (server) {
+    // ftruncate zero-filled the indices, publish the layout last
+    hdr->ring_size = ring_sz;
+    atomic_store_explicit(&hdr->magic, SHM_MAGIC, memory_order_release);
+  } else if (atomic_load_explicit(&hdr->magic, memory_order_acquire) != SHM_MAGIC) {
+    logMsg(SOCKET_LOG_ERROR, "shared memory object %s is not initialised", obj_name);
+    exit(EXIT_FAILURE);
+  } else ring_sz = hdr->ring_size;
+
+  // Server to client ring first, client to server ring second
+  spsc_ring_t rings[2];
+  uint8_t * p = (uint8_t *) s->shm + sizeof(shm_header_t);
+  for (int i = 0; i < 2; i++) {
+    rings[i].idx = (ring_idx_t *) p;
+    rings[i].data = p + sizeof(ring_idx_t);
+    rings[i].size = ring_sz;
+    rings[i].wake_fd = -1;
+    p += sizeof(ring_idx_t) + ring_sz;
+  }
+  s->ring_tx = rings[server ? 0 : 1];
+  s->ring_rx = rings[server ? 1 : 0];
+  s->sock = fd;
+  logMsg(SOCKET_LOG_INFO, "%s socket using shared memory %s with %u byte rings", s->name, obj_name, ring_sz);
+}
+
+// Read the socket options to apply: a <name>_TCP_PROFILE of low-latency
+// (Nagle off, quick acks, busy polling) or bulk (large buffers), then
+// <name>_TCP_NODELAY, _TCP_QUICKACK, _BUSY_POLL (in us), _SNDBUF and
+// _RCVBUF (in bytes) overriding individual options
+void sockTuneInit(serv_socket_state_t * s)
+{
+  char* profile = getSocketEnv(s->name, "TCP_PROFILE");
+  if (profile != NULL && strcmp(profile, "low-latency") == 0) {
+    s->tcp_nodelay = 1;
+    s->tcp_quickack = 1;
+    s->busy_poll_us = LOW_LATENCY_BUSY_POLL_US;
+  } else if (profile != NULL && strcmp(profile, "bulk") == 0) {
+    s->sndbuf = BULK_SOCK_BUF_SZ;
+    s->rcvbuf = BULK_SOCK_BUF_SZ;
+  } else if (profile != NULL && strcmp(profile, "default") != 0)
+    logMsg(SOCKET_LOG_WARN, "%s socket ignoring unknown %s_TCP_PROFILE %s", s->name, s->name, profile);
+  s->tcp_nodelay = (int) getSocketEnvInt(s->name, "TCP_NODELAY", s->tcp_nodelay);
+  s->tcp_quickack = (int) getSocketEnvInt(s->name, "TCP_QUICKACK", s->tcp_quickack);
+  s->busy_poll_us = (int) getSocketEnvInt(s->name, "BUSY_POLL", s->busy_poll_us);
+  s->sndbuf = (int) getSocketEnvInt(s->name, "SNDBUF", s->sndbuf);
+  s->rcvbuf = (int) getSocketEnvInt(s->name, "RCVBUF", s->rcvbuf);
+}
+
+// Set a socket option if configured, warning if the system refuses it
+void sockSetOpt(serv_socket_state_t * s, int fd, int level, int opt, int val, const char * what)
+{
+  if (val < 0) return;
+  if (setsockopt(fd, level, opt, &val, sizeof(val)) == -1)
+    logMsg(SOCKET_LOG_WARN, "%s socket could not set %s: %s", s->name, what, strerror(errno));
+}
+
+// Apply the configured options to a listening or connected socket. The
+// TCP ones only apply on the TCP transport. Quick acks are not sticky on
+// Linux, so only take effect until the connection next delays an ack.
+void sockTune(serv_socket_state_t * s, int fd)
+{
+  sockSetOpt(s, fd, SOL_SOCKET, SO_SNDBUF, s->sndbuf, "SO_SNDBUF");
+  sockSetOpt(s, fd, SOL_SOCKET, SO_RCVBUF, s->rcvbuf, "SO_RCVBUF");
+  if (s->path[0] != '\0') return;
+  sockSetOpt(s, fd, IPPROTO_TCP, TCP_NODELAY, s->tcp_nodelay, "TCP_NODELAY");
+#ifdef TCP_QUICKACK
+  sockSetOpt(s, fd, IPPROTO_TCP, TCP_QUICKACK, s->tcp_quickack, "TCP_QUICKACK");
+#endif
+#ifdef SO_BUSY_POLL
+  sockSetOpt(s, fd, SOL_SOCKET, SO_BUSY_POLL, s->busy_poll_us, "SO_BUSY_POLL");
+#endif
+}
+
+// Resolve the address to bind or connect to from <name>_ADDR, one of host,
+// host:port, [v6]:port or a bare IPv6 address, given by name or number. A
+// port in it overrides <name>_PORT. An empty host binds to all IPv4
+// interfaces, and connects over loopback, while :: binds to all IPv4 and
+// IPv6 ones. Defaults to loopback. The caller frees the result.
+struct addrinfo * sockResolve(serv_socket_state_t * s, bool server)
+{
+  char* env = getSocketEnv(s->name, "ADDR");
+  char host[STR_BUFF_SZ];
+  char* port = NULL;
+  if (env == NULL) strcpy(host, "127.0.0.1");
+  else if (strlen(env) >= sizeof(host)) {
+    logMsg(SOCKET_LOG_ERROR, "%s_ADDR is too long", s->name);
+    exit(EXIT_FAILURE);
+  } else if (env[0] == '[') {
+    char* end = strchr(env, ']');
+    if (end == NULL || (end[1] != '\0' && end[1] != ':')) {
+      logMsg(SOCKET_LOG_ERROR, "malformed %s_ADDR %s", s->name, env);
+      exit(EXIT_FAILURE);
+    }
+    memcpy(host, env + 1, end - env - 1);
+    host[end - env - 1] = '\0';
+    if (end[1] == ':') port = end + 2;
+  } else {
+    strcpy(host, env);
+    // A single colon separates the port, more make it an IPv6 address
+    char* colon = strchr(host, ':');
+    if (colon != NULL && strchr(colon + 1, ':') == NULL) {
+      *colon = '\0';
+      port = colon + 1;
+    }
+  }
+  if (port != NULL && *port != '\0') {
+    int p = atoi(port);
+    assert(p >= 0 && p <= 65535);
+    s->port = p;
+  } else s->port = getPortNumber(s->name, s->port);
+
+  char service[16];
+  snprintf(service, sizeof(service), "%d", s->port);
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | (server ? AI_PASSIVE : 0);
+  struct addrinfo * ai = NULL;
+  if (host[0] == '\0') strcpy(host, server ? "0.0.0.0" : "127.0.0.1");
+  int ret = getaddrinfo(host, service, &hints, &ai);
+  if (ret != 0) {
+    logMsg(SOCKET_LOG_ERROR, "could not resolve %s for %s: %s", host, s->name, gai_strerror(ret));
+    exit(EXIT_FAILURE);
+  }
+  return ai;
+}
+
+// Bind the listening socket of s to the first of the resolved addresses
+// that takes it, in the order getaddrinfo(3) lists them
+void sockBind(serv_socket_state_t * s, struct addrinfo * ai)
+{
+  int err = 0;
+  for (struct addrinfo * a = ai; a != NULL; a = a->ai_next) {
+    s->sock = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (s->sock == -1) {
+      err = errno;
+      continue;
+    }
+    sockTune(s, s->sock);
+    int opt = 1;
+    if (a->ai_family != AF_UNIX && setsockopt(s->sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+      logMsg(SOCKET_LOG_ERROR, "could not set SO_REUSEADDR on the %s socket: %s", s->name, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    // Let an IPv6 wildcard accept IPv4 clients too
+    opt = 0;
+    if (a->ai_family == AF_INET6)
+      sockSetOpt(s, s->sock, IPPROTO_IPV6, IPV6_V6ONLY, opt, "IPV6_V6ONLY");
+    if (bind(s->sock, a->ai_addr, a->ai_addrlen) == 0) return;
+    err = errno;
+    close(s->sock);
+    s->sock = -1;
+  }
+  logMsg(SOCKET_LOG_ERROR, "could not bind the %s socket: %s", s->name, strerror(err));
+  exit(EXIT_FAILURE);
+}
+
+// Note the addresses the peer of s resolved to, a client connecting to
+// each in turn until one takes it
+void sockPeers(serv_socket_state_t * s, struct addrinfo * ai)
+{
+  s->npeers = 0;
+  for (struct addrinfo * a = ai; a != NULL; a = a->ai_next) s->npeers++;
+  s->peers = (socket_peer_t *) calloc (s->npeers, sizeof(socket_peer_t));
+  if (s->peers == NULL) {
+    logMsg(SOCKET_LOG_ERROR, "could not allocate the peer addresses of %s", s->name);
+    exit(EXIT_FAILURE);
+  }
+  int i = 0;
+  for (struct addrinfo * a = ai; a != NULL; a = a->ai_next, i++) {
+    memcpy(&s->peers[i].addr, a->ai_addr, a->ai_addrlen);
+    s->peers[i].len = a->ai_addrlen;
+  }
+  s->peer_idx = 0;
+  s->peer_tries = 0;
+  memcpy(&s->peer_addr, &s->peers[0].addr, s->peers[0].len);
+  s->peer_len = s->peers[0].len;
+}
+
+// Whether the peer of a connected socket is on another machine. Unix
+// domain sockets, loopback addresses and non-sockets are all local.
+bool sockIsRemote(int fd)
+{
+  struct sockaddr_storage peer;
+  socklen_t len = sizeof(peer);
+  if (getpeername(fd, (struct sockaddr *) &peer, &len) == -1) return false;
+  if (peer.ss_family == AF_INET) {
+    struct sockaddr_in * in = (struct sockaddr_in *) &peer;
+    return (ntohl(in->sin_addr.s_addr) >> 24) != 127;
+  }
+  if (peer.ss_family == AF_INET6) {
+    struct in6_addr * a = &((struct sockaddr_in6 *) &peer)->sin6_addr;
+    if (IN6_IS_ADDR_LOOPBACK(a)) return false;
+    return !(IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+  }
+  return false;
+}
+
+// io_uring backend
+////////////////////////////////////////////////////////////////////////////////
+
+// Sockets with <name>_IO_URING set do their reads, writes and accepts
+// through one io_uring shared by the whole process, instead of a system
+// call each. A socket keeps a multishot receive in flight whenever
+// connected, the kernel filling buffers from a provided buffer ring as
+// data arrives and the completions queueing them up for the socket's next
+// read to copy out, which only looks at the completion queue. A socket
+// holding UR_SOCK_BUFS unread buffers has its receive cancelled until its
+// reads drain them, so that a peer sending faster than it is read neither
+// takes the buffers the other sockets need nor escapes flow control. A write
+// copies its data and queues a send, one at a time per socket, with
+// queued requests submitted together by the next call into any socket
+// using the ring, or straight away by a flush or a wait, making for one
+// io_uring_enter(2) per round of calls, or none when the ring has a
+// kernel polling thread (SOCKET_PACKET_UTILS_IO_URING_SQPOLL_MS set to its
+// idle time). Requests hold on to their socket, so they are cancelled
+// before any socket closes, and those of an earlier connection are told
+// apart by the epoch in their user data.
+//
+// Not used in multi-client mode or by I/O threads, and only built on Linux
+// with headers from 6.0 onwards (SOCKET_PACKET_UTILS_NO_IO_URING leaving
+// it out), sockets falling back to plain system calls otherwise.
+#ifdef IO_URING_BACKEND
+
+#define UR_RECV 1
+#define UR_SEND 2
+#define UR_ACCEPT 3
+#define UR_CANCEL 4
+#define UR_STOP 5
+
+typedef struct {
+  int fd;
+  bool sqpoll;
+  // Submission queue, sq_tail being the next entry to fill and
+  // sq_submitted the first not passed to the kernel yet
+  _Atomic uint32_t* sq_khead;
+  _Atomic uint32_t* sq_ktail;
+  _Atomic uint32_t* sq_flags;
+  uint32_t* sq_array;
+  struct io_uring_sqe* sqes;
+  uint32_t sq_mask;
+  uint32_t sq_entries;
+  uint32_t sq_tail;
+  uint32_t sq_submitted;
+  // Completion queue
+  _Atomic uint32_t* cq_khead;
+  _Atomic uint32_t* cq_ktail;
+  struct io_uring_cqe* cqes;
+  uint32_t cq_mask;
+  // Provided receive buffers, UR_BUFS of UR_BUF_SZ bytes in buffer group 0
+  struct io_uring_buf_ring* br;
+  _Atomic uint16_t* br_ktail;
+  uint16_t br_tail;
+  uint8_t* bufs;
+  // Sends in flight, over all sockets, for the exit handler to wait for
+  int sending;
+} uring_t;
+
+// The shared ring, once uring_state is 1 (-1 if it could not be set up).
+// The ring and the backend state of every socket belong to whoever holds
+// uring_lock, taken by each entry point of the backend.
+uring_t uring;
+int uring_state = 0;
+pthread_mutex_t uring_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+// Per-socket state of the backend
+typedef struct socket_uring {
+  // Bumped on every disconnect, completions of requests made on an
+  // earlier connection being ignored
+  uint32_t epoch;
+  // Requests in flight, and which
+  int ops;
+  bool recv_armed;
+  bool accept_armed;
+  bool cancelling;
+  // Whether the receive is being cancelled for holding too many buffers
+  bool recv_stopping;
+  // Connection accepted but not taken yet, -1 if none
+  int accepted;
+  // How the receive ended: 0 if it has not, -1 at end of file, or errno
+  int rx_err;
+  // Filled buffers in arrival order, rx_off bytes of the first one
+  // having been read
+  uint16_t rx_bid[UR_BUFS];
+  uint32_t rx_len[UR_BUFS];
+  uint32_t rx_first;
+  uint32_t rx_n;
+  uint32_t rx_off;
+  // Copy of the data being sent while tx_busy, and the errno a send
+  // failed with, if any
+  uint8_t* tx;
+  size_t tx_cap;
+  size_t tx_len;
+  bool tx_busy;
+  int tx_err;
+} socket_uring_t;
+
+// Give a receive buffer back to the kernel
+void uringBufReturn(uint16_t bid)
+{
+  struct io_uring_buf * b = &uring.br->bufs[uring.br_tail & (UR_BUFS - 1)];
+  b->addr = (uint64_t) (uintptr_t) &uring.bufs[(size_t) bid * UR_BUF_SZ];
+  b->len = UR_BUF_SZ;
+  b->bid = bid;
+  uring.br_tail++;
+  atomic_store_explicit(uring.br_ktail, uring.br_tail, memory_order_release);
+}
+
+// Set up the shared ring, returning NULL on success or why it failed
+const char* uringSetup(void)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  char* sqpoll = getenv("SOCKET_PACKET_UTILS_IO_URING_SQPOLL_MS");
+  if (sqpoll != NULL) {
+    p.flags |= IORING_SETUP_SQPOLL;
+    p.sq_thread_idle = atoi(sqpoll);
+  }
+  uring.fd = (int) syscall(__NR_io_uring_setup, UR_ENTRIES, &p);
+  if (uring.fd == -1) return strerror(errno);
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+    close(uring.fd);
+    return "kernel too old";
+  }
+  uring.sqpoll = sqpoll != NULL;
+
+  // Map the queues
+  size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+  size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  uint8_t* rings = (uint8_t *) mmap(NULL, sq_sz > cq_sz ? sq_sz : cq_sz, PROT_READ|PROT_WRITE,
+                                    MAP_SHARED|MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+  void* sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+  if (rings == MAP_FAILED || sqes == MAP_FAILED) {
+    logMsg(SOCKET_LOG_ERROR, "could not map the io_uring rings: %s", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  uring.sq_khead = (_Atomic uint32_t *) (rings + p.sq_off.head);
+  uring.sq_ktail = (_Atomic uint32_t *) (rings + p.sq_off.tail);
+  uring.sq_flags = (_Atomic uint32_t *) (rings + p.sq_off.flags);
+  uring.sq_array = (uint32_t *) (rings + p.sq_off.array);
+  uring.sq_mask = *(uint32_t *) (rings + p.sq_off.ring_mask);
+  uring.sq_entries = p.sq_entries;
+  uring.sq_tail = atomic_load_explicit(uring.sq_ktail, memory_order_relaxed);
+  uring.sq_submitted = uring.sq_tail;
+  uring.sqes = (struct io_uring_sqe *) sqes;
+  uring.cq_khead = (_Atomic uint32_t *) (rings + p.cq_off.head);
+  uring.cq_ktail = (_Atomic uint32_t *) (rings + p.cq_off.tail);
+  uring.cq_mask = *(uint32_t *) (rings + p.cq_off.ring_mask);
+  uring.cqes = (struct io_uring_cqe *) (rings + p.cq_off.cqes);
+
+  // Register the receive buffers
+  void* br;
+  if (posix_memalign(&br, sysconf(_SC_PAGESIZE), UR_BUFS * sizeof(struct io_uring_buf)) != 0 ||
+      (uring.bufs = (uint8_t *) malloc ((size_t) UR_BUFS * UR_BUF_SZ)) == NULL) {
+    logMsg(SOCKET_LOG_ERROR, "could not allocate the io_uring receive buffers");
+    exit(EXIT_FAILURE);
+  }
+  memset(br, 0, UR_BUFS * sizeof(struct io_uring_buf));
+  uring.br = (struct io_uring_buf_ring *) br;
+  uring.br_ktail = (_Atomic uint16_t *) &uring.br->tail;
+  uring.br_tail = 0;
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) br;
+  reg.ring_entries = UR_BUFS;
+  reg.bgid = 0;
+  if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+    const char* why = strerror(errno);
+    close(uring.fd);
+    free(br);
+    free(uring.bufs);
+    return why;
+  }
+  for (int i = 0; i < UR_BUFS; i++) uringBufReturn(i);
+  return NULL;
+}
+
+// Pass the queued requests to the kernel, then wait for a completion for
+// up to timeout_ms (forever if negative) if wait is set
+void uringSubmit(bool wait, int timeout_ms)
+{
+  pthread_mutex_lock(&uring_lock);
+  uint32_t to_submit = uring.sq_tail - uring.sq_submitted;
+  unsigned flags = 0;
+  if (uring.sqpoll) {
+    // The polling thread takes them, once woken up if idle
+    uring.sq_submitted = uring.sq_tail;
+    if (to_submit > 0 && (atomic_load_explicit(uring.sq_flags, memory_order_acquire) & IORING_SQ_NEED_WAKEUP))
+      flags |= IORING_ENTER_SQ_WAKEUP;
+    to_submit = 0;
+  }
+  // Completions the kernel had no room for need an enter to come through
+  if (atomic_load_explicit(uring.sq_flags, memory_order_relaxed) & IORING_SQ_CQ_OVERFLOW)
+    flags |= IORING_ENTER_GETEVENTS;
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  void* argp = NULL;
+  size_t arg_sz = 0;
+  if (wait) {
+    flags |= IORING_ENTER_GETEVENTS;
+    if (timeout_ms >= 0) {
+      ts.tv_sec = timeout_ms / 1000;
+      ts.tv_nsec = (long long) (timeout_ms % 1000) * 1000000;
+      memset(&arg, 0, sizeof(arg));
+      arg.ts = (uint64_t) (uintptr_t) &ts;
+      argp = &arg;
+      arg_sz = sizeof(arg);
+      flags |= IORING_ENTER_EXT_ARG;
+    }
+  }
+  if (to_submit > 0 || flags != 0) {
+    int n = (int) syscall(__NR_io_uring_enter, uring.fd, to_submit, wait ? 1 : 0, flags, argp, arg_sz);
+    if (n >= 0) uring.sq_submitted += n;
+    else if (errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY) {
+      logMsg(SOCKET_LOG_ERROR, "io_uring_enter failed: %s", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+  pthread_mutex_unlock(&uring_lock);
+}
+
+// Next free submission queue entry, cleared, to be queued by uringPush
+struct io_uring_sqe* uringSqe(void)
+{
+  while (uring.sq_tail - atomic_load_explicit(uring.sq_khead, memory_order_acquire) == uring.sq_entries) {
+    if (uring.sqpoll) syscall(__NR_io_uring_enter, uring.fd, 0, 0, IORING_ENTER_SQ_WAIT, NULL, 0);
+    else uringSubmit(false, 0);
+  }
+  uint32_t i = uring.sq_tail & uring.sq_mask;
+  struct io_uring_sqe * sqe = &uring.sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  uring.sq_array[i] = i;
+  return sqe;
+}
+
+// Queue a request of kind op about s, filled in from uringSqe
+void uringPush(serv_socket_state_t * s, struct io_uring_sqe * sqe, int op)
+{
+  sqe->user_data = ((uint64_t) HANDLE_INDEX(s->handle) << 32) | ((uint64_t) (s->ur->epoch & 0xffffff) << 8) | op;
+  s->ur->ops++;
+  uring.sq_tail++;
+  atomic_store_explicit(uring.sq_ktail, uring.sq_tail, memory_order_release);
+}
+
+// Account for a completion
+void uringComplete(struct io_uring_cqe * cqe)
+{
+  serv_socket_state_t * s = socketSlot((cqe->user_data >> 32) - 1);
+  socket_uring_t * u = s->ur;
+  int op = cqe->user_data & 0xff;
+  bool current = ((cqe->user_data >> 8) & 0xffffff) == (u->epoch & 0xffffff);
+  bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+  if (!more) u->ops--;
+  switch (op) {
+    case UR_RECV:
+      if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (current && cqe->res > 0) {
+          uint32_t i = (u->rx_first + u->rx_n++) % UR_BUFS;
+          u->rx_bid[i] = bid;
+          u->rx_len[i] = cqe->res;
+        } else uringBufReturn(bid);
+      }
+      if (!current) break;
+      // Rearmed by the next read once out of buffers or stopped
+      if (cqe->res == 0) u->rx_err = -1;
+      else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) u->rx_err = -cqe->res;
+      if (!more) {
+        u->recv_armed = false;
+        u->recv_stopping = false;
+      }
+      if (more && u->rx_n >= UR_SOCK_BUFS && !u->recv_stopping) {
+        // Stop the receive, which the owner of s rearms from its reads.
+        // Only the ring is touched, s possibly belonging to another thread.
+        struct io_uring_sqe * sqe = uringSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = cqe->user_data;
+        uringPush(s, sqe, UR_STOP);
+        u->recv_stopping = true;
+      }
+      break;
+    case UR_SEND:
+      u->tx_busy = false;
+      uring.sending--;
+      if (current && (cqe->res < 0 || (size_t) cqe->res < u->tx_len))
+        u->tx_err = cqe->res < 0 ? -cqe->res : EPIPE;
+      break;
+    case UR_ACCEPT:
+      u->accept_armed = false;
+      if (cqe->res >= 0) {
+        if (current && u->accepted == -1) u->accepted = cqe->res;
+        else close(cqe->res);
+      }
+      break;
+    case UR_CANCEL:
+      u->cancelling = false;
+      break;
+  }
+}
+
+// Submit what is queued and go through the completions
+void uringReap(void)
+{
+  uringSubmit(false, 0);
+  uint32_t head = atomic_load_explicit(uring.cq_khead, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(uring.cq_ktail, memory_order_acquire);
+  while (head != tail) {
+    uringComplete(&uring.cqes[head & uring.cq_mask]);
+    head++;
+    if (head == tail) tail = atomic_load_explicit(uring.cq_ktail, memory_order_acquire);
+  }
+  atomic_store_explicit(uring.cq_khead, head, memory_order_release);
+}
+
+// Give sends in flight at exit some time to complete
+void uringExit(void)
+{
+  if (uring_state != 1) return;
+  pthread_mutex_lock(&uring_lock);
+  uint64_t deadline = monotonicNs() + UR_EXIT_MS * 1000000ull;
+  uringReap();
+  while (uring.sending > 0 && monotonicNs() < deadline) {
+    uringSubmit(true, 1);
+    uringReap();
+  }
+  pthread_mutex_unlock(&uring_lock);
+}
+
+// A forked child gets a ring of its own when it needs one, the sockets it
+// inherited falling back to plain system calls rather than sharing the
+// parent's ring. Only the forking thread carries on in the child, so the
+// lock starts afresh.
+void uringForked(void)
+{
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&uring_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  if (uring_state != 1) return;
+  for (size_t i = 0; i < socket_count; i++) {
+    serv_socket_state_t * s = socketSlot(i);
+    if (!s->in_use || s->ur == NULL) continue;
+    free(s->ur->tx);
+    free(s->ur);
+    s->ur = NULL;
+  }
+  close(uring.fd);
+  free(uring.br);
+  free(uring.bufs);
+  uring_state = 0;
+}
+
+// Use the shared ring for s if <name>_IO_URING is set and it can
+void uringStart(serv_socket_state_t * s)
+{
+  if (s->ur != NULL || getSocketEnvInt(s->name, "IO_URING", 0) == 0) return;
+  if (s->io_worker || s->clients != NULL) {
+    logMsg(SOCKET_LOG_WARN, "%s socket ignoring %s_IO_URING, not supported %s", s->name, s->name,
+           s->io_worker ? "with an I/O thread" : "in multi-client mode");
+    return;
+  }
+  pthread_mutex_lock(&uring_lock);
+  if (uring_state == 0) {
+    const char* why = uringSetup();
+    if (why != NULL)
+      logMsg(SOCKET_LOG_WARN, "could not set up io_uring (%s), using plain system calls", why);
+    else {
+      static bool uring_atexit = false;
+      if (!uring_atexit) {
+        atexit(uringExit);
+        pthread_atfork(NULL, NULL, uringForked);
+      }
+      uring_atexit = true;
+    }
+    uring_state = why == NULL ? 1 : -1;
+  }
+  pthread_mutex_unlock(&uring_lock);
+  if (uring_state != 1) return;
+  s->ur = (socket_uring_t *) calloc (1, sizeof(socket_uring_t));
+  if (s->ur == NULL) {
+    logMsg(SOCKET_LOG_ERROR, "could not allocate the io_uring state of %s", s->name);
+    exit(EXIT_FAILURE);
+  }
+  s->ur->accepted = -1;
+  logMsg(SOCKET_LOG_INFO, "%s socket using io_uring", s->name);
+}
+
+// Make sure the request that brings s new data is in flight: a receive
+// when connected, or an accept on a listening server
+void uringArm(serv_socket_state_t * s)
+{
+  socket_uring_t * u = s->ur;
+  pthread_mutex_lock(&uring_lock);
+  if (s->conn != -1 && !u->recv_armed && u->rx_err == 0 && u->rx_n < UR_SOCK_BUFS) {
+    struct io_uring_sqe * sqe = uringSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = s->conn;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    uringPush(s, sqe, UR_RECV);
+    u->recv_armed = true;
+    uringSubmit(false, 0);
+  } else if (s->conn == -1 && s->peer_len == 0 && s->sock != -1 &&
+             !u->accept_armed && u->accepted == -1) {
+    struct io_uring_sqe * sqe = uringSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = s->sock;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    uringPush(s, sqe, UR_ACCEPT);
+    u->accept_armed = true;
+    uringSubmit(false, 0);
+  }
+  pthread_mutex_unlock(&uring_lock);
+}
+
+// Whether a read or accept on s would find something
+bool uringReady(serv_socket_state_t * s)
+{
+  pthread_mutex_lock(&uring_lock);
+  uringReap();
+  bool ready = s->ur->rx_n > 0 || s->ur->rx_err != 0 || s->ur->accepted != -1;
+  pthread_mutex_unlock(&uring_lock);
+  return ready;
+}
+
+// Whether a send from s is still in flight
+bool uringSending(serv_socket_state_t * s)
+{
+  pthread_mutex_lock(&uring_lock);
+  uringReap();
+  bool busy = s->ur->tx_busy;
+  pthread_mutex_unlock(&uring_lock);
+  return busy;
+}
+
+// Non-blocking read from the connection of s, returning like read(2)
+int uringRead(serv_socket_state_t * s, void * buf, size_t nbytes)
+{
+  socket_uring_t * u = s->ur;
+  pthread_mutex_lock(&uring_lock);
+  uringReap();
+  uint8_t* bytes = (uint8_t *) buf;
+  size_t got = 0;
+  while (got < nbytes && u->rx_n > 0) {
+    uint16_t bid = u->rx_bid[u->rx_first];
+    uint32_t len = u->rx_len[u->rx_first];
+    size_t n = len - u->rx_off < nbytes - got ? len - u->rx_off : nbytes - got;
+    memcpy(&bytes[got], &uring.bufs[(size_t) bid * UR_BUF_SZ + u->rx_off], n);
+    got += n;
+    u->rx_off += n;
+    if (u->rx_off == len) {
+      uringBufReturn(bid);
+      u->rx_first = (u->rx_first + 1) % UR_BUFS;
+      u->rx_n--;
+      u->rx_off = 0;
+    }
+  }
+  int r = got;
+  if (got == 0 && u->rx_err == -1) r = 0;
+  else if (got == 0 && u->rx_err != 0) {
+    errno = u->rx_err;
+    r = -1;
+  } else if (got == 0) {
+    errno = EAGAIN;
+    r = -1;
+  }
+  // Keep data coming, or start it again once drained below the quota
+  if (u->rx_err == 0) uringArm(s);
+  pthread_mutex_unlock(&uring_lock);
+  return r;
+}
+
+// Non-blocking write to the connection of s, returning like write(2).
+// The data is copied and sent by the next submission.
+int uringWrite(serv_socket_state_t * s, const void * buf, size_t nbytes)
+{
+  socket_uring_t * u = s->ur;
+  pthread_mutex_lock(&uring_lock);
+  uringReap();
+  if (u->tx_err != 0 || u->tx_busy) {
+    errno = u->tx_err != 0 ? u->tx_err : EAGAIN;
+    pthread_mutex_unlock(&uring_lock);
+    return -1;
+  }
+  if (nbytes > u->tx_cap) {
+    size_t cap = nbytes > UR_BUF_SZ ? nbytes : UR_BUF_SZ;
+    uint8_t* tx = (uint8_t *) realloc (u->tx, cap);
+    if (tx == NULL) {
+      logMsg(SOCKET_LOG_ERROR, "could not grow the io_uring send buffer for %s", s->name);
+      exit(EXIT_FAILURE);
+    }
+    u->tx = tx;
+    u->tx_cap = cap;
+  }
+  memcpy(u->tx, buf, nbytes);
+  struct io_uring_sqe * sqe = uringSqe();
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = s->conn;
+  sqe->addr = (uint64_t) (uintptr_t) u->tx;
+  sqe->len = nbytes;
+  // Have the kernel send it all, as nothing else gets sent meanwhile
+  sqe->msg_flags = MSG_WAITALL|MSG_NOSIGNAL;
+  uringPush(s, sqe, UR_SEND);
+  u->tx_len = nbytes;
+  u->tx_busy = true;
+  uring.sending++;
+  pthread_mutex_unlock(&uring_lock);
+  return nbytes;
+}
+
+// Non-blocking accept on the listening socket of s, returning like accept
+int uringAccept(serv_socket_state_t * s)
+{
+  pthread_mutex_lock(&uring_lock);
+  uringReap();
+  int fd = s->ur->accepted;
+  s->ur->accepted = -1;
+  if (fd == -1) {
+    uringArm(s);
+    errno = EAGAIN;
+  }
+  pthread_mutex_unlock(&uring_lock);
+  return fd;
+}
+
+// Sleep until a completion arrives, for up to ms milliseconds. This only
+// waits in the kernel, touching nothing uring_lock guards, so it is done
+// without the lock for other threads to go on using the ring.
+void uringSleep(int ms)
+{
+  struct __kernel_timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (long long) (ms % 1000) * 1000000;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (uint64_t) (uintptr_t) &ts;
+  syscall(__NR_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+          &arg, sizeof(arg));
+}
+
+// Wait until s is readable (to_write false) or has no send in flight (to_write
+// true), or until timeout_ms expires if non-negative, as connWait. The
+// ring is not held while blocked, so another thread may reap the
+// completion being waited for: the wait is cut to UR_WAIT_MS for the
+// caller to look again.
+void uringWait(serv_socket_state_t * s, bool to_write, int timeout_ms)
+{
+  pthread_mutex_lock(&uring_lock);
+  if (!to_write) uringArm(s);
+  bool done = to_write ? !uringSending(s) : uringReady(s);
+  pthread_mutex_unlock(&uring_lock);
+  if (done) return;
+  uringSleep(timeout_ms < 0 || timeout_ms > UR_WAIT_MS ? UR_WAIT_MS : timeout_ms);
+}
+
+// Wait until the cancel s made has completed, or all its requests if all.
+// Called without uring_lock, which is only held to reap, so that threads
+// using other sockets are not stalled while the kernel lets go of these.
+void uringSettle(serv_socket_state_t * s, bool all)
+{
+  for (;;) {
+    pthread_mutex_lock(&uring_lock);
+    uringSubmit(false, 0);
+    uringReap();
+    bool done = all ? s->ur->ops == 0 : !s->ur->cancelling;
+    pthread_mutex_unlock(&uring_lock);
+    if (done) return;
+    uringSleep(UR_WAIT_MS);
+  }
+}
+
+// Cancel the requests on fd made by s, waiting for the kernel to let go
+// of it. Called without uring_lock, as uringSettle.
+void uringCancel(serv_socket_state_t * s, int fd)
+{
+  pthread_mutex_lock(&uring_lock);
+  struct io_uring_sqe * sqe = uringSqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD|IORING_ASYNC_CANCEL_ALL;
+  uringPush(s, sqe, UR_CANCEL);
+  s->ur->cancelling = true;
+  pthread_mutex_unlock(&uring_lock);
+  uringSettle(s, false);
+}
+
+// Forget about the connection of s before it is closed, dropping what it
+// received and making it start over on the next one
+void uringDisconnect(serv_socket_state_t * s)
+{
+  socket_uring_t * u = s->ur;
+  pthread_mutex_lock(&uring_lock);
+  uringReap();
+  bool busy = u->ops > 0;
+  pthread_mutex_unlock(&uring_lock);
+  if (busy) uringCancel(s, s->conn);
+  pthread_mutex_lock(&uring_lock);
+  for (; u->rx_n > 0; u->rx_n--) {
+    uringBufReturn(u->rx_bid[u->rx_first]);
+    u->rx_first = (u->rx_first + 1) % UR_BUFS;
+  }
+  // A cancelled send still owns tx until it completes
+  u->epoch++;
+  u->rx_off = 0;
+  u->rx_err = 0;
+  u->tx_err = 0;
+  u->recv_armed = false;
+  u->recv_stopping = false;
+  pthread_mutex_unlock(&uring_lock);
+}
+
+// Cancel everything in flight for s, which is being destroyed
+void uringDestroy(serv_socket_state_t * s)
+{
+  socket_uring_t * u = s->ur;
+  if (s->conn != -1) uringDisconnect(s);
+  pthread_mutex_lock(&uring_lock);
+  bool accepting = u->accept_armed;
+  pthread_mutex_unlock(&uring_lock);
+  if (accepting) uringCancel(s, s->sock);
+  uringSettle(s, true);
+  pthread_mutex_lock(&uring_lock);
+  if (u->accepted != -1) close(u->accepted);
+  free(u->tx);
+  free(u);
+  s->ur = NULL;
+  pthread_mutex_unlock(&uring_lock);
+}
+
+// The shared ring's file descriptor, readable when completions are
+// waiting, or -1 if none
+int uringFd(void)
+{
+  return uring_state == 1 ? uring.fd : -1;
+}
+
+#else
+
+void uringStart(serv_socket_state_t * s)
+{
+  if (getSocketEnvInt(s->name, "IO_URING", 0) != 0)
+    logMsg(SOCKET_LOG_WARN, "%s socket ignoring %s_IO_URING, not supported by this build", s->name, s->name);
+}
+void uringSubmit(bool wait, int timeout_ms) { (void) wait; (void) timeout_ms; }
+void uringArm(serv_socket_state_t * s) { (void) s; }
+bool uringReady(serv_socket_state_t * s) { (void) s; return false; }
+bool uringSending(serv_socket_state_t * s) { (void) s; return false; }
+int uringRead(serv_socket_state_t * s, void * buf, size_t nbytes) { (void) s; (void) buf; (void) nbytes; return -1; }
+int uringWrite(serv_socket_state_t * s, const void * buf, size_t nbytes) { (void) s; (void) buf; (void) nbytes; return -1; }
+int uringAccept(serv_socket_state_t * s) { (void) s; return -1; }
+void uringWait(serv_socket_state_t * s, bool to_write, int timeout_ms) { (void) s; (void) to_write; (void) timeout_ms; }
+void uringDisconnect(serv_socket_state_t * s) { (void) s; }
+void uringDestroy(serv_socket_state_t * s) { (void) s; }
+int uringFd(void) { return -1; }
+
+#endif
+
+// Non-blocking accept of a pending connection on a listening socket,
+// returning the new, non-blocking connection or -1 if there is none.
+// accept4() sets the flag in the same call, falling back to fcntl() on
+// kernels without it.
+int acceptFd(serv_socket_state_t * s)
+{
+  if (s->ur != NULL) return uringAccept(s);
+#ifdef SOCK_NONBLOCK
+  static _Atomic bool no_accept4 = false;
+  if (!no_accept4) {
+    int fd = accept4(s->sock, NULL, NULL, SOCK_NONBLOCK);
+    if (fd != -1 || (errno != ENOSYS && errno != EINVAL)) return fd;
+    no_accept4 = true;
+  }
+#endif
+  int fd = accept(s->sock, NULL, NULL);
+  if (fd != -1) socketSetNonBlocking(fd);
+  return fd;
+}
+
+// Set the delimiters of the records get_until reads from spec, a string
+// of delimiter bytes in which \n, \r, \t, \\ and \xHH escapes may be used
+void delimParse(serv_socket_state_t * s, const char * spec)
+{
+  s->ndelims = 0;
+  memset(s->delim_map, 0, sizeof(s->delim_map));
+  for (const char* p = spec; *p != '\0'; p++) {
+    uint8_t b = *p;
+    if (b == '\\' && p[1] != '\0') {
+      p++;
+      if (*p == 'n') b = '\n';
+      else if (*p == 'r') b = '\r';
+      else if (*p == 't') b = '\t';
+      else if (*p == 'x' && isxdigit((unsigned char) p[1])) {
+        char hex[3] = { p[1], isxdigit((unsigned char) p[2]) ? p[2] : '\0', '\0' };
+        b = (uint8_t) strtol(hex, NULL, 16);
+        p += hex[1] != '\0' ? 2 : 1;
+      } else b = *p;
+    }
+    if (s->delim_map[b >> 3] & (1 << (b & 7))) continue;
+    if (s->ndelims == DELIMS_MAX) {
+      logMsg(SOCKET_LOG_ERROR, "more than %d delimiters in %s_DELIMS", DELIMS_MAX, s->name);
+      exit(EXIT_FAILURE);
+    }
+    s->delims[s->ndelims++] = b;
+    s->delim_map[b >> 3] |= 1 << (b & 7);
+  }
+  // Records need a delimiter to end them
+  if (s->ndelims == 0) {
+    logMsg(SOCKET_LOG_WARN, "%s_DELIMS is empty, using a newline", s->name);
+    delimParse(s, "\\n");
+  }
+}
+
+void ioThreadStart(serv_socket_state_t * s, bool server);
+void clientConnect(serv_socket_state_t * s);
+
+void socket_init(unsigned long long ptr, bool server)
+{
+  serv_socket_state_t * s = socketState(ptr);
+  // A client between connection attempts has no socket
+  if (s->sock != -1 || s->peer_len != 0) return;
+
+  // Ignore SIGPIPE
+  signal(SIGPIPE, SIG_IGN);
+
+  s->put_timeout_ms = (int) getSocketEnvInt(s->name, "PUT_TIMEOUT_MS", DFLT_PUT_TIMEOUT_MS);
+  s->backoff_max = (int) getSocketEnvInt(s->name, "BACKOFF_MAX", DFLT_BACKOFF_MAX);
+  if (s->backoff_max < 1) s->backoff_max = 1;
+
+  // Print counters at exit
+  static bool stats_atexit = false;
+  if (!s->io_worker && getSocketEnvInt(s->name, "STATS", 0) != 0) {
+    s->stats_dump = true;
+    atexitOnce(&stats_atexit, statDumpAll);
+  }
+
+  // Latency histograms
+  if (!s->io_worker && s->lat == NULL && getSocketEnvInt(s->name, "LATENCY", 0) != 0) {
+    s->lat = (socket_latency_t *) calloc (1, sizeof(socket_latency_t));
+    if (s->lat == NULL) {
+      logMsg(SOCKET_LOG_ERROR, "could not allocate the latency histograms of %s", s->name);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Delimiters of the records get_until reads, a newline by default
+  char* delims = getSocketEnv(s->name, "DELIMS");
+  delimParse(s, delims != NULL ? delims : "\\n");
+  s->delim_trailer = getSocketEnvInt(s->name, "DELIM_TRAILER", 0);
+
+  // Capture traffic, and replay it instead of using a socket
+  char* capture = getSocketEnv(s->name, "CAPTURE");
+  if (capture != NULL && !s->io_worker && s->capture == NULL) {
+    s->capture = traceOpen(capture, true);
+    atexitOnce(&traces_atexit, traceCloseAll);
+    logMsg(SOCKET_LOG_INFO, "%s socket capturing traffic to %s", s->name, capture);
+  }
+  char* replay = getSocketEnv(s->name, "REPLAY");
+  if (replay != NULL && !s->io_worker) {
+    s->replay = traceOpen(replay, false);
+    s->sock = s->replay->fd;
+    // Deliver data at the very calls it was captured at
+    s->backoff_max = 1;
+    logMsg(SOCKET_LOG_INFO, "%s socket replaying traffic from %s", s->name, replay);
+    return;
+  }
+
+  // Hand the socket over to a background I/O thread
+  if (!s->io_worker && getSocketEnvInt(s->name, "IO_THREAD", 0) != 0) {
+    ioThreadStart(s, server);
+    return;
+  }
+
+  // Write-combining configuration
+  long tx_sz = getSocketEnvInt(s->name, "TX_COMBINE", 0);
+  if (tx_sz > 0 && s->tx_buf == NULL) {
+    s->tx_buf = (uint8_t *) malloc (tx_sz);
+    if (s->tx_buf == NULL) {
+      logMsg(SOCKET_LOG_ERROR, "could not allocate the write-combining buffer for %s", s->name);
+      exit(EXIT_FAILURE);
+    }
+    s->tx_cap = tx_sz;
+    s->tx_combine = true;
+    s->tx_flush_calls = (int) getSocketEnvInt(s->name, "TX_FLUSH_CALLS", 0);
+    logMsg(SOCKET_LOG_INFO, "%s socket combining writes in a %ld byte buffer", s->name, tx_sz);
+  }
+
+  // Shared memory transport
+  char* shm_name = getSocketEnv(s->name, "SHM");
+  if (shm_name != NULL && !s->io_worker) {
+    shmInit(s, shm_name, server);
+    return;
+  }
+
+  // Create socket, in the unix domain if a path is given. A client's is
+  // created as it connects, for the address it is trying.
+  bool unix_domain = getSocketPath(s->name, s->path, sizeof(s->path));
+  struct addrinfo * ai = unix_domain ? NULL : sockResolve(s, server);
+  sockTuneInit(s);
+  if (unix_domain) {
+    struct sockaddr_un unAddr;
+    memset(&unAddr, 0, sizeof(unAddr));
+    unAddr.sun_family = AF_UNIX;
+    strcpy(unAddr.sun_path, s->path);
+    struct addrinfo un;
+    memset(&un, 0, sizeof(un));
+    un.ai_family = AF_UNIX;
+    un.ai_socktype = SOCK_STREAM;
+    un.ai_addr = (struct sockaddr *) &unAddr;
+    un.ai_addrlen = sizeof(unAddr);
+    if (server) {
+      // Remove a stale socket left behind by a previous server
+      struct stat st;
+      if (stat(s->path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(s->path);
+      sockBind(s, &un);
+    } else sockPeers(s, &un);
+  } else if (server) sockBind(s, ai);
+  else sockPeers(s, ai);
+
+  if (server) {
+    // Multi-client mode
+    int max_clients = (int) getSocketEnvInt(s->name, "MAX_CLIENTS", 1);
+    if (max_clients > 1 && s->io_worker)
+      logMsg(SOCKET_LOG_WARN, "%s socket ignoring %s_MAX_CLIENTS, not supported with an I/O thread",
+             s->name, s->name);
+    else if (max_clients > 1) {
+      s->clients = (socket_client_t *) calloc (max_clients, sizeof(socket_client_t));
+      if (s->clients == NULL) {
+        logMsg(SOCKET_LOG_ERROR, "could not allocate the clients of %s", s->name);
+        exit(EXIT_FAILURE);
+      }
+      s->max_clients = max_clients;
+      if (s->tx_buf == NULL) {
+        long fanout_sz = getSocketEnvInt(s->name, "FANOUT_SIZE", DFLT_FANOUT_SZ);
+        s->tx_buf = (uint8_t *) malloc (fanout_sz);
+        if (s->tx_buf == NULL) {
+          logMsg(SOCKET_LOG_ERROR, "could not allocate the fan-out buffer for %s", s->name);
+          exit(EXIT_FAILURE);
+        }
+        s->tx_cap = fanout_sz;
+      }
+      logMsg(SOCKET_LOG_INFO, "%s socket accepting up to %d clients", s->name, max_clients);
+    }
+
+    // Listen for connections, with room for a burst of them to queue up
+    int backlog = (int) getSocketEnvInt(s->name, "BACKLOG", DFLT_BACKLOG);
+    if (backlog < s->max_clients) backlog = s->max_clients;
+    if (listen(s->sock, backlog) == -1) {
+      logMsg(SOCKET_LOG_ERROR, "could not listen on the %s socket: %s", s->name, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    // Start connecting, finishing on later calls
+    s->connect_timeout_ms = (int) getSocketEnvInt(s->name, "CONNECT_TIMEOUT_MS", DFLT_CONNECT_TIMEOUT_MS);
+    s->reconnect_min_ms = (int) getSocketEnvInt(s->name, "RECONNECT_MS", DFLT_RECONNECT_MS);
+    s->reconnect_max_ms = (int) getSocketEnvInt(s->name, "RECONNECT_MAX_MS", DFLT_RECONNECT_MAX_MS);
+    if (s->reconnect_min_ms < 1) s->reconnect_min_ms = 1;
+    if (s->reconnect_max_ms < s->reconnect_min_ms) s->reconnect_max_ms = s->reconnect_min_ms;
+    s->reconnect_ms = s->reconnect_min_ms;
+    clientConnect(s);
+  }
+
+  // Make it non-blocking
+  if (s->sock != -1) socketSetNonBlocking(s->sock);
+  uringStart(s);
+
+  char* bind_addr = getSocketEnv(s->name, "ADDR");
+  if (unix_domain)
+    logMsg(SOCKET_LOG_INFO, "%s socket listening on path %s", s->name, s->path);
+  else if (bind_addr != NULL)
+    logMsg(SOCKET_LOG_INFO, "%s socket listening on %s port %d", s->name, bind_addr, s->port);
+  else
+    logMsg(SOCKET_LOG_INFO, "%s socket listening on port %d", s->name, s->port);
+  if (ai != NULL) freeaddrinfo(ai);
+}
+
+// Stop watching a file descriptor of s in the poll set s belongs to
+void pollSetUnwatch(serv_socket_state_t * s, int fd)
+{
+  if (s->poll_set == NULL || ringTransport(s) || s->replay != NULL) return;
+#ifdef __linux__
+  epoll_ctl(s->poll_set->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+}
+
+// Register a file descriptor of s with the poll set s belongs to
+void pollSetWatch(serv_socket_state_t * s, int fd)
+{
+  if (s->poll_set == NULL || ringTransport(s) || s->replay != NULL) return;
+#ifdef __linux__
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = s;
+  if (epoll_ctl(s->poll_set->epfd, EPOLL_CTL_ADD, fd, &ev) == -1 && errno != EEXIST) {
+    logMsg(SOCKET_LOG_ERROR, "could not add the %s socket to its poll set: %s", s->name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+#endif
+}
+
+// Number of received bytes waiting to be delivered
+size_t rxAvailable(serv_socket_state_t * s)
+{
+  return s->rx_tail - s->rx_head;
+}
+
+// Make sure a packet of nbytes fits in the receive buffer from rx_head
+// onwards, moving pending data to the front and growing it if need be
+void rxReserve(serv_socket_state_t * s, size_t nbytes)
+{
+  if (nbytes > s->rx_cap) {
+    uint8_t* buf = (uint8_t *) realloc (s->rx_buf, nbytes);
+    if (buf == NULL) {
+      logMsg(SOCKET_LOG_ERROR, "could not grow the receive buffer for %s", s->name);
+      exit(EXIT_FAILURE);
+    }
+    s->rx_buf = buf;
+    s->rx_cap = nbytes;
+  }
+  if (s->rx_head == s->rx_tail) {
+    s->rx_head = 0;
+    s->rx_tail = 0;
+  } else if (s->rx_head + nbytes > s->rx_cap || s->rx_tail == s->rx_cap) {
+    memmove(s->rx_buf, &s->rx_buf[s->rx_head], rxAvailable(s));
+    s->rx_tail -= s->rx_head;
+    s->rx_head = 0;
+  }
+}
+
+// Multi-client mode
+////////////////////////////////////////////////////////////////////////////////
+
+// Release the part of the shared transmit buffer sent to all clients,
+// dropping the output altogether when no client is left
+void mcTrim(serv_socket_state_t * s)
+{
+  size_t head = s->tx_tail;
+  for (int i = 0; i < s->nclients; i++)
+    if (s->clients[i].tx_off < head) head = s->clients[i].tx_off;
+  s->tx_head = head;
+  if (s->tx_head == s->tx_tail) {
+    for (int i = 0; i < s->nclients; i++) s->clients[i].tx_off = 0;
+    s->tx_head = 0;
+    s->tx_tail = 0;
+  }
+}
+
+// Point conn at the first client still connected, if any
+void mcUpdateConn(serv_socket_state_t * s)
+{
+  s->conn = -1;
+  for (int i = 0; i < s->nclients && s->conn == -1; i++) s->conn = s->clients[i].fd;
+}
+
+// Close the connection of client c, which sends and receives no more
+void mcClose(serv_socket_state_t * s, socket_client_t * c)
+{
+  if (c->fd == -1) return;
+  pollSetUnwatch(s, c->fd);
+  close(c->fd);
+  c->fd = -1;
+  c->tx_off = s->tx_tail;
+  mcUpdateConn(s);
+}
+
+// Disconnect client i, moving the last client into its slot. The slot's
+// receive buffer is kept for reuse.
+void mcDrop(serv_socket_state_t * s, int i)
+{
+  socket_client_t * c = &s->clients[i];
+  mcClose(s, c);
+  if (s->nclients == s->max_clients) pollSetWatch(s, s->sock);
+  s->nclients--;
+  socket_client_t tmp = *c;
+  *c = s->clients[s->nclients];
+  s->clients[s->nclients] = tmp;
+  mcUpdateConn(s);
+  mcTrim(s);
+  logMsg(SOCKET_LOG_DEBUG, "%s socket lost a client (%d left)", s->name, s->nclients);
+}
+
+// Take on an accepted connection as a new client
+void mcAdd(serv_socket_state_t * s, int fd)
+{
+  sockTune(s, fd);
+  socket_client_t * c = &s->clients[s->nclients++];
+  if (c->rx_buf == NULL) {
+    c->rx_buf = (uint8_t *) malloc (RX_BUFF_SZ);
+    if (c->rx_buf == NULL) {
+      logMsg(SOCKET_LOG_ERROR, "could not allocate a client receive buffer for %s", s->name);
+      exit(EXIT_FAILURE);
+    }
+    c->rx_cap = RX_BUFF_SZ;
+  }
+  c->fd = fd;
+  c->rx_head = 0;
+  c->rx_tail = 0;
+  c->rx_piece = false;
+  // Output queued before the client connected is not sent to it
+  c->tx_off = s->tx_tail;
+  mcUpdateConn(s);
+  s->stats.connections++;
+  pollSetWatch(s, fd);
+  if (s->nclients == s->max_clients) pollSetUnwatch(s, s->sock);
+  logMsg(SOCKET_LOG_DEBUG, "%s socket got a connection (%d clients)", s->name, s->nclients);
+}
+
+// Accept pending clients while there is room for them, checking only every
+// MC_ACCEPT_CALLS calls while clients are connected and no poll set says
+// when to
+void mcAccept(serv_socket_state_t * s)
+{
+  if (s->nclients == s->max_clients) return;
+  if (s->nclients > 0 && s->poll_set == NULL && ++s->accept_calls < MC_ACCEPT_CALLS) return;
+  s->accept_calls = 0;
+  while (s->nclients < s->max_clients) {
+    int fd = acceptFd(s);
+    if (fd == -1) return;
+    mcAdd(s, fd);
+  }
+}
+
+// Non-blocking write of the shared transmit buffer to every client.
+// Returns true when nothing is left pending.
+bool mcFlush(serv_socket_state_t * s)
+{
+  for (int i = 0; i < s->nclients; i++) {
+    socket_client_t * c = &s->clients[i];
+    if (c->fd == -1 || c->tx_off == s->tx_tail) continue;
+    s->stats.write_calls++;
+    int n = write(c->fd, &s->tx_buf[c->tx_off], s->tx_tail - c->tx_off);
+    if (n > 0) c->tx_off += n;
+    else if (!(n == -1 && errno == EAGAIN)) mcDrop(s, i--);
+  }
+  mcTrim(s);
+  return s->tx_head == s->tx_tail;
+}
+
+// Make room for nbytes at the end of the shared transmit buffer, once it
+// has been flushed and compacted, by growing it for a packet larger than
+// the whole buffer and by dropping the clients furthest behind, as long as
+// some other client is further ahead
+void mcMakeRoom(serv_socket_state_t * s, size_t nbytes)
+{
+  if (nbytes > s->tx_cap) {
+    uint8_t* buf = (uint8_t *) realloc (s->tx_buf, nbytes);
+    if (buf == NULL) {
+      logMsg(SOCKET_LOG_ERROR, "could not grow the fan-out buffer for %s", s->name);
+      exit(EXIT_FAILURE);
+    }
+    s->tx_buf = buf;
+    s->tx_cap = nbytes;
+  }
+  while (s->tx_cap - s->tx_tail + s->tx_head < nbytes) {
+    bool ahead = false;
+    for (int i = 0; i < s->nclients; i++) ahead |= s->clients[i].tx_off > s->tx_head;
+    if (!ahead) return;
+    for (int i = 0; i < s->nclients; i++)
+      if (s->clients[i].tx_off == s->tx_head) {
+        logMsg(SOCKET_LOG_WARN, "%s socket dropping a client that fell behind", s->name);
+        mcDrop(s, i--);
+      }
+  }
+}
+
+// Size of the next packet buffered for client c: rx_unit, for records the
+// size of the next one (or rx_record bytes of it, if longer), or for
+// messages the size of the next one including its prefix, 0 if that is
+// not known yet or -1 if the prefix is malformed
+long mcUnit(serv_socket_state_t * s, socket_client_t * c)
+{
+  if (s->rx_unit > 0) return s->rx_unit;
+  if (s->rx_record > 0) {
+    size_t avail = c->rx_tail - c->rx_head;
+    size_t limit = avail < s->rx_record ? avail : s->rx_record;
+    size_t i = delimFind(&c->rx_buf[c->rx_head], limit, s->delims, s->ndelims, s->delim_map);
+    size_t len = i < limit ? i + 1 + s->delim_trailer : s->rx_record;
+    if (len > s->rx_record) len = s->rx_record;
+    return avail >= len ? (long) len : 0;
+  }
+  size_t len;
+  int hdr = msgHeader(&c->rx_buf[c->rx_head], c->rx_tail - c->rx_head, &len);
+  return (hdr <= 0) ? hdr : (long) (hdr + len);
+}
+
+// Read what every client has sent into its own buffer, then merge whole
+// packets (or messages) into the receive buffer, one per client in turn.
+// Returns the number of bytes merged.
+int mcFill(serv_socket_state_t * s)
+{
+  for (int i = 0; i < s->nclients; i++) {
+    socket_client_t * c = &s->clients[i];
+    long need = mcUnit(s, c);
+    if (need == -1) {
+      logMsg(SOCKET_LOG_WARN, "%s socket dropping a client that sent a malformed message", s->name);
+      mcDrop(s, i--);
+      continue;
+    }
+    size_t unit = (need > 0) ? (size_t) need : (s->rx_record > 0) ? s->rx_record : MSG_HDR_MAX;
+    if (c->rx_head == c->rx_tail) {
+      c->rx_head = 0;
+      c->rx_tail = 0;
+    } else if (c->rx_tail == c->rx_cap || c->rx_head + unit > c->rx_cap) {
+      memmove(c->rx_buf, &c->rx_buf[c->rx_head], c->rx_tail - c->rx_head);
+      c->rx_tail -= c->rx_head;
+      c->rx_head = 0;
+    }
+    if (unit > c->rx_cap) {
+      uint8_t* buf = (uint8_t *) realloc (c->rx_buf, unit);
+      if (buf == NULL) {
+        logMsg(SOCKET_LOG_ERROR, "could not grow a client receive buffer for %s", s->name);
+        exit(EXIT_FAILURE);
+      }
+      c->rx_buf = buf;
+      c->rx_cap = unit;
+    }
+    if (c->fd == -1 || c->rx_tail == c->rx_cap) continue;
+    s->stats.read_calls++;
+    int n = read(c->fd, &c->rx_buf[c->rx_tail], c->rx_cap - c->rx_tail);
+    if (n > 0) c->rx_tail += n;
+    else if (!(n == -1 && errno == EAGAIN)) mcClose(s, c);
+  }
+  int merged = 0;
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    // The client part way through a record, if any, goes on alone
+    int piece = -1;
+    for (int i = 0; i < s->nclients && s->rx_record > 0; i++)
+      if (s->clients[i].rx_piece) piece = i;
+    for (int k = 0; k < s->nclients; k++) {
+      if (piece != -1) s->rx_next = piece;
+      if (s->rx_next >= s->nclients) s->rx_next = 0;
+      socket_client_t * c = &s->clients[s->rx_next++];
+      long unit = mcUnit(s, c);
+      if (unit <= 0 || c->rx_tail - c->rx_head < (size_t) unit) {
+        if (piece != -1) break;
+        continue;
+      }
+      if (s->rx_cap - s->rx_tail < (size_t) unit) {
+        if (merged > 0) return merged;
+        rxReserve(s, rxAvailable(s) + unit);
+      }
+      if (s->rx_record > 0)
+        c->rx_piece = delimFind(&c->rx_buf[c->rx_head], unit, s->delims, s->ndelims, s->delim_map) == (size_t) unit;
+      memcpy(&s->rx_buf[s->rx_tail], &c->rx_buf[c->rx_head], unit);
+      c->rx_head += unit;
+      s->rx_tail += unit;
+      merged += unit;
+      progress = true;
+      if (piece != -1 || c->rx_piece) break;
+    }
+  }
+  // Drop closed clients once nothing more can be merged from them
+  for (int i = 0; i < s->nclients; i++) {
+    socket_client_t * c = &s->clients[i];
+    long unit = mcUnit(s, c);
+    if (c->fd == -1 && (unit <= 0 || c->rx_tail - c->rx_head < (size_t) unit)) mcDrop(s, i--);
+  }
+  return merged;
+}
+
+// Give up on the current connection attempt, trying again after the
+// reconnect delay, which doubles on every failure in a row
+void clientRetry(serv_socket_state_t * s, const char * why)
+{
+  if (s->reconnect_ms == s->reconnect_min_ms)
+    logMsg(SOCKET_LOG_DEBUG, "%s socket could not connect (%s), retrying", s->name, why);
+  if (s->sock != -1) close(s->sock);
+  s->sock = -1;
+  s->connecting = false;
+  // Try the next address the peer resolved to, backing off once all failed
+  s->peer_idx = (s->peer_idx + 1) % s->npeers;
+  memcpy(&s->peer_addr, &s->peers[s->peer_idx].addr, s->peers[s->peer_idx].len);
+  s->peer_len = s->peers[s->peer_idx].len;
+  if (++s->peer_tries < s->npeers) {
+    clientConnect(s);
+    return;
+  }
+  s->peer_tries = 0;
+  s->reconnect_ns = monotonicNs() + (uint64_t) s->reconnect_ms * 1000000ull;
+  s->reconnect_ms = s->reconnect_ms * 2 > s->reconnect_max_ms ? s->reconnect_max_ms : s->reconnect_ms * 2;
+}
+
+// The connect of the client socket completed
+void clientConnected(serv_socket_state_t * s)
+{
+  s->connecting = false;
+  s->conn = s->sock;
+  s->reconnect_ms = s->reconnect_min_ms;
+  s->peer_tries = 0;
+  s->stats.connections++;
+  // Drop any partial packet left over from a previous connection
+  s->rx_head = 0;
+  s->rx_tail = 0;
+  logMsg(SOCKET_LOG_DEBUG, "%s socket connected", s->name);
+}
+
+// Start a non-blocking connect to the server, on a fresh socket unless
+// one was already created
+void clientConnect(serv_socket_state_t * s)
+{
+  if (s->sock == -1) {
+    s->sock = socket(s->peer_addr.ss_family, SOCK_STREAM, 0);
+    if (s->sock == -1) {
+      clientRetry(s, strerror(errno));
+      return;
+    }
+    sockTune(s, s->sock);
+  }
+  socketSetNonBlocking(s->sock);
+  pollSetWatch(s, s->sock);
+  s->connect_ns = monotonicNs();
+  if (connect(s->sock, (struct sockaddr *) &s->peer_addr, s->peer_len) == 0) clientConnected(s);
+  else if (errno == EINPROGRESS) s->connecting = true;
+  else clientRetry(s, strerror(errno));
+}
+
+// Make progress towards a client connection: see if a connect in progress
+// has completed or timed out, or start a new one once the reconnect delay
+// is over
+void clientPoll(serv_socket_state_t * s)
+{
+  if (s->connecting) {
+    struct pollfd pfd;
+    pfd.fd = s->sock;
+    pfd.events = POLLOUT;
+    if (poll(&pfd, 1, 0) <= 0) {
+      if (monotonicNs() - s->connect_ns >= (uint64_t) s->connect_timeout_ms * 1000000ull)
+        clientRetry(s, "timed out");
+      return;
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(s->sock, SOL_SOCKET, SO_ERROR, &err, &len) == -1) err = errno;
+    if (err != 0) clientRetry(s, strerror(err));
+    else clientConnected(s);
+  } else if (s->sock == -1 && monotonicNs() >= s->reconnect_ns) clientConnect(s);
+}
+
+// Accept connection
+void acceptConnection(serv_socket_state_t * s, bool server)
+{
+  if (s->conn != -1 && s->clients == NULL) return;
+  if (s->sock == -1 && s->peer_len == 0) socket_init(s->handle, server);
+  if (s->peer_len != 0) {
+    clientPoll(s);
+    return;
+  }
+
+  if (s->clients != NULL) {
+    mcAccept(s);
+    return;
+  }
+
+  if (s->io != NULL) {
+    if (atomic_load_explicit(&s->io->connected, memory_order_acquire)) {
+      s->conn = s->io->wake[1];
+      s->stats.connections++;
+    }
+    return;
+  }
+
+  if (server && s->shm == NULL && s->replay == NULL) {
+    // Accept connection
+    s->conn = acceptFd(s);
+    if (s->conn != -1) {
+      logMsg(SOCKET_LOG_DEBUG, "%s socket got a connection", s->name);
+      s->stats.connections++;
+      sockTune(s, s->conn);
+      // Only watch the listening socket while not connected
+      pollSetUnwatch(s, s->sock);
+      pollSetWatch(s, s->conn);
+      // Drop any partial packet left over from a previous connection
+      s->rx_head = 0;
+      s->rx_tail = 0;
+    }
+  } else {
+    s->conn = s->sock;
+    s->stats.connections++;
+  }
+}
+
+// Close the current connection, dropping any writes still pending for it
+void closeConnection(serv_socket_state_t * s)
+{
+  if (s->clients != NULL) {
+    while (s->nclients > 0) mcDrop(s, 0);
+    return;
+  }
+  if (s->ur != NULL) uringDisconnect(s);
+  close(s->conn);
+  if (s->conn != s->sock) pollSetWatch(s, s->sock);
+  else if (s->peer_len != 0) {
+    // Reconnect after the minimum delay
+    logMsg(SOCKET_LOG_DEBUG, "%s socket lost the connection, reconnecting", s->name);
+    s->sock = -1;
+    s->reconnect_ms = s->reconnect_min_ms;
+    s->reconnect_ns = monotonicNs() + (uint64_t) s->reconnect_ms * 1000000ull;
+  }
+  s->conn = -1;
+  s->tx_head = 0;
+  s->tx_tail = 0;
+  // Dropped writes never complete
+  if (s->lat != NULL) s->lat->tx.n = 0;
+}
+
+// Non-blocking read from the current connection, returning like read(2)
+int connRead(serv_socket_state_t * s, void * buf, size_t nbytes)
+{
+  s->stats.read_calls++;
+  if (s->replay != NULL) {
+    int n = traceRead(s->replay, s->calls, buf, nbytes);
+    if (n == -1 && !s->replay->ended && traceNext(s->replay, &s->replay->rd, TRACE_GET) == NULL) {
+      logMsg(SOCKET_LOG_INFO, "%s socket reached the end of trace %s", s->name, s->replay->file);
+      s->replay->ended = true;
+    }
+    return n;
+  }
+  if (ringTransport(s)) {
+    int n = ringRead(&s->ring_rx, buf, nbytes);
+    if (n > 0) return n;
+    errno = EAGAIN;
+    return -1;
+  }
+  if (s->ur != NULL) return uringRead(s, buf, nbytes);
+  return read(s->conn, buf, nbytes);
+}
+
+// Non-blocking write to the current connection, returning like write(2)
+int connWrite(serv_socket_state_t * s, const void * buf, size_t nbytes)
+{
+  s->stats.write_calls++;
+  if (s->replay != NULL) {
+    // Writes go nowhere, but are checked against the captured ones
+    if (!s->replay->diverged && !traceCheck(s->replay, buf, nbytes)) {
+      logMsg(SOCKET_LOG_WARN, "%s socket output diverged from trace %s at call %llu",
+             s->name, s->replay->file, (unsigned long long) s->calls);
+      s->replay->diverged = true;
+    }
+    return nbytes;
+  }
+  if (ringTransport(s)) {
+    int n = ringWrite(&s->ring_tx, buf, nbytes);
+    if (n > 0) return n;
+    errno = EAGAIN;
+    return -1;
+  }
+  if (s->ur != NULL) return uringWrite(s, buf, nbytes);
+  return write(s->conn, buf, nbytes);
+}
+
+// Wait until the current connection is readable (to_write false) or
+// writable (to_write true), or until timeout_ms expires if non-negative
+void connWait(serv_socket_state_t * s, bool to_write, int timeout_ms)
+{
+  uint64_t start = monotonicNs();
+  if (ringTransport(s))
+    ringWait(to_write ? &s->ring_tx : &s->ring_rx, to_write, timeout_ms);
+  else if (s->ur != NULL)
+    uringWait(s, to_write, timeout_ms);
+  else {
+    struct pollfd pfd;
+    pfd.fd = s->conn;
+    pfd.events = to_write ? POLLOUT : POLLIN;
+    int res = poll(&pfd, 1, timeout_ms);
+    assert(res >= 0 || errno == EINTR);
+  }
+  s->stats.blocked_ns += monotonicNs() - start;
+}
+
+// Account for n bytes read into the receive buffer, those a get already
+// found in the ring having been marked then
+void rxArrived(serv_socket_state_t * s, size_t n)
+{
+  socket_latency_t * l = s->lat;
+  size_t seen = n < l->ring_seen ? n : l->ring_seen;
+  l->ring_seen -= seen;
+  if (n > seen) latMark(l, &l->rx, n - seen);
+}
+
+// Top up the receive buffer with a single non-blocking read, closing the
+// connection on end-of-file or error. Returns the number of bytes read.
+int rxFill(serv_socket_state_t * s)
+{
+  if (s->conn == -1 && s->nclients == 0) return 0;
+  rxReserve(s, 1);
+  if (s->rx_tail == s->rx_cap) return 0;
+  if (s->clients != NULL) {
+    int n = mcFill(s);
+    if (n > 0 && s->lat != NULL) latMark(s->lat, &s->lat->rx, n);
+    return n;
+  }
+  int n = connRead(s, &s->rx_buf[s->rx_tail], s->rx_cap - s->rx_tail);
+  if (n > 0) {
+    s->rx_tail += n;
+    if (s->lat != NULL) rxArrived(s, n);
+    return n;
+  }
+  if (!(n == -1 && errno == EAGAIN)) closeConnection(s);
+  return 0;
+}
+
+// Accept a pending connection if need be and top up the receive buffer,
+// unless the last poll of the socket's poll set found nothing to do, or
+// the socket is idle and backing off
+void rxPoll(serv_socket_state_t * s, bool server)
+{
+  if (s->poll_set != NULL) {
+    if (!s->poll_ready) return;
+    acceptConnection(s, server);
+    if (rxFill(s) == 0) s->poll_ready = false;
+    return;
+  }
+  if (s->backoff_skip > 0) {
+    s->backoff_skip--;
+    return;
+  }
+  acceptConnection(s, server);
+  if (rxFill(s) > 0) backoffReset(s);
+  else if (++s->idle_polls >= BACKOFF_IDLE_POLLS) {
+    if (s->backoff < s->backoff_max)
+      s->backoff = s->backoff * 2 > s->backoff_max ? s->backoff_max : s->backoff * 2;
+    s->backoff_skip = s->backoff - 1;
+  }
+}
+
+// Number of bytes waiting in the write-combining buffer
+size_t txPending(serv_socket_state_t * s)
+{
+  return s->tx_tail - s->tx_head;
+}
+
+// Account for the latency of the puts that the last write completed
+void txSent(serv_socket_state_t * s)
+{
+  if (s->lat == NULL || txPending(s) > s->lat->tx.bytes) return;
+  latTx(s->lat, s->lat->tx.bytes - txPending(s));
+}
+
+// Account for the latency of the data a get just took from the receive
+// buffer
+void rxDelivered(serv_socket_state_t * s)
+{
+  if (s->lat != NULL) latRx(s->lat, s->lat->rx.bytes - rxAvailable(s) - s->lat->ring_seen);
+}
+
+// Non-blocking write of as much of the write-combining buffer as the
+// connection accepts. Returns true when nothing is left pending.
+bool txFlush(serv_socket_state_t * s)
+{
+  s->tx_calls = 0;
+  if (txPending(s) == 0) return true;
+  if (s->conn == -1) return false;
+  if (s->clients != NULL) {
+    bool done = mcFlush(s);
+    txSent(s);
+    return done;
+  }
+  int n = connWrite(s, &s->tx_buf[s->tx_head], txPending(s));
+  if (n > 0) {
+    s->tx_head += n;
+    txSent(s);
+  } else if (!(n == -1 && errno == EAGAIN)) {
+    closeConnection(s);
+    return false;
+  }
+  if (s->tx_head == s->tx_tail) {
+    s->tx_head = 0;
+    s->tx_tail = 0;
+    return true;
+  }
+  return false;
+}
+
+// Move the bytes pending transmission to the front of the transmit buffer
+void txCompact(serv_socket_state_t * s)
+{
+  if (s->tx_head == 0) return;
+  memmove(s->tx_buf, &s->tx_buf[s->tx_head], txPending(s));
+  for (int i = 0; i < s->nclients; i++) s->clients[i].tx_off -= s->tx_head;
+  s->tx_tail -= s->tx_head;
+  s->tx_head = 0;
+}
+
+// Queue nbytes for transmission in the write-combining (or fan-out)
+// buffer, flushing it first if need be. Returns false if there is no room
+// for them.
+bool txAppend(serv_socket_state_t * s, const uint8_t* bytes, size_t nbytes)
+{
+  if (s->tx_cap - s->tx_tail < nbytes) {
+    txFlush(s);
+    txCompact(s);
+    if (s->tx_cap - s->tx_tail < nbytes && s->clients != NULL) {
+      mcMakeRoom(s, nbytes);
+      txCompact(s);
+    }
+    if (s->tx_cap - s->tx_tail < nbytes) return false;
+  }
+  memcpy(&s->tx_buf[s->tx_tail], bytes, nbytes);
+  s->tx_tail += nbytes;
+  if (s->tx_tail == s->tx_cap) txFlush(s);
+  return true;
+}
+
+// Keep nbytes the connection did not accept yet at the end of the
+// transmit buffer, growing it if need be
+void txKeep(serv_socket_state_t * s, const uint8_t* bytes, size_t nbytes)
+{
+  txCompact(s);
+  s->stats.partial_writes++;
+  if (s->tx_cap - s->tx_tail < nbytes) {
+    uint8_t* buf = (uint8_t *) realloc (s->tx_buf, s->tx_tail + nbytes);
+    if (buf == NULL) {
+      logMsg(SOCKET_LOG_ERROR, "could not grow the transmit buffer for %s", s->name);
+      exit(EXIT_FAILURE);
+    }
+    s->tx_buf = buf;
+    s->tx_cap = s->tx_tail + nbytes;
+  }
+  memcpy(&s->tx_buf[s->tx_tail], bytes, nbytes);
+  s->tx_tail += nbytes;
+}
+
+// Count a call into the socket, pushing out the rest of a partly written
+// packet, or flushing the write-combining buffer every tx_flush_calls calls
+void txTick(serv_socket_state_t * s)
+{
+  if (txPending(s) == 0) return;
+  if (!s->tx_combine ||
+      (s->tx_flush_calls > 0 && ++s->tx_calls >= s->tx_flush_calls))
+    txFlush(s);
+}
+
+
+// Non-blocking read of 8 bits
+uint32_t socket_get8(unsigned long long ptr, bool server)
+{
+  serv_socket_state_t * s = socketState(ptr);
+  txTick(s);
+  if (rxAvailable(s) == 0) {
+    s->rx_unit = 1;
+    rxPoll(s, server);
+    if (rxAvailable(s) == 0) {
+      statGet(s, NULL, 0);
+      return -1;
+    }
+  }
+  uint8_t byte = s->rx_buf[s->rx_head++];
+  statGet(s, &byte, 1);
+  rxDelivered(s);
+  return (uint32_t) byte;
+}
+
+// Non-blocking write of 8 bits
+uint8_t socket_put8(unsigned long long ptr, uint8_t byte, bool server)
+{
+  serv_socket_state_t * s = socketState(ptr);
+  acceptConnection(s, server);
+  if (s->conn == -1) {
+    statPut(s, NULL, 0);
+    return 0;
+  }
+  if (s->tx_combine || s->clients != NULL) {
+    if (!txAppend(s, &byte, 1)) {
+      statPut(s, NULL, 0);
+      return 0;
+    }
+    txTick(s);
+    statPut(s, &byte, 1);
+    return 1;
+  }
+  // Finish sending an earlier, partly written packet first
+  int n = txFlush(s) ? connWrite(s, &byte, 1) : 0;
+  if (n == 1) {
+    statPut(s, &byte, 1);
+    return 1;
+  }
+  else if (n != 0 && !(n == -1 && errno == EAGAIN)) closeConnection(s);
+  statPut(s, NULL, 0);
+  return 0;
+}
+
+// Blocking write of 8 bits, waiting for the connection to become writable
+// for up to put_timeout_ms in total
+uint8_t socket_put8_blocking(unsigned long long ptr, uint8_t byte, bool server)
+{
+  serv_socket_state_t * s = socketState(ptr);
+  if (socket_put8(ptr, byte, server)) return 1;
+  uint64_t deadline = monotonicNs() + (uint64_t) s->put_timeout_ms * 1000000ull;
+  while (s->conn != -1) {
+    uint64_t now = monotonicNs();
+    if (now >= deadline) {
+      logMsg(SOCKET_LOG_WARN, "%s socket timed out sending byte", s->name);
+      return 0;
+    }
+    connWait(s, true, (int) ((deadline - now + 999999) / 1000000));
+    if (socket_put8(ptr, byte, server)) return 1;
+  }
+  return 0;
+}
+
+
+// Try to read an N-byte packet into result, returning true if one was
+// available. Non-blocking on N-byte boundaries: a partly received packet
+// is only delivered once a later call finds the rest of it.
+bool rxGet(serv_socket_state_t * s, void* result, size_t nbytes, bool server)
+{
+  txTick(s);
+  if (rxAvailable(s) == 0 && ringTransport(s) && nbytes <= s->ring_rx.size) {
+    // Copy whole packets straight out of the ring
+    size_t avail = ringAvailable(&s->ring_rx);
+    if (s->lat != NULL && avail > s->lat->ring_seen) {
+      latMark(s->lat, &s->lat->rx, avail - s->lat->ring_seen);
+      s->lat->ring_seen = avail;
+    }
+    if (avail >= nbytes) {
+      ringRead(&s->ring_rx, result, nbytes);
+      if (s->lat != NULL) s->lat->ring_seen -= nbytes;
+      statGet(s, result, nbytes);
+      rxDelivered(s);
+      return true;
+    }
+    statGet(s, NULL, 0);
+    return false;
+  }
+  if (rxAvailable(s) < nbytes) {
+    rxReserve(s, nbytes);
+    s->rx_unit = nbytes;
+    rxPoll(s, server);
+    // A partial packet stays buffered until the rest of it arrives
+    if (rxAvailable(s) < nbytes) {
+      s->rx_partial = rxAvailable(s) > 0;
+      statGet(s, NULL, 0);
+      return false;
+    }
+  }
+  if (s->rx_partial) s->stats.partial_reads++;
+  s->rx_partial = false;
+  memcpy(result, &s->rx_buf[s->rx_head], nbytes);
+  s->rx_head += nbytes;
+  statGet(s, result, nbytes);
+  rxDelivered(s);
+  return true;
+}
+
+// Try to read N bytes from socket, giving N+1 byte result. Bottom N
+// bytes contain data and MSB is 0 if data is valid or non-zero if no
+// data is available.  Non-blocking on N-byte boundaries: a partly received
+// packet is only delivered once a later call finds the rest of it.
+void socket_getN(void* result, unsigned long long ptr, int nbytes, bool server)
+{
+  uint8_t* bytes = (uint8_t*) result;
+  bytes[nbytes] = rxGet(socketState(ptr), bytes, nbytes, server) ? 0 : 0xff;
+}
+
+// Try to write N bytes to socket.  Non-blocking on N-bytes boundaries,
+// returning 0 when no write performed. When only part of the packet is
+// written, the rest is sent by later calls, which accept no new data in
+// the meantime.
+uint8_t socket_putN(unsigned long long ptr, int nbytes, unsigned int* data, bool server)
+{
+  serv_socket_state_t * s = socketState(ptr);
+  acceptConnection(s, server);
+  if (s->conn == -1) {
+    statPut(s, NULL, 0);
+    return 0;
+  }
+  uint8_t* bytes = (uint8_t*) data;
+  if (s->tx_combine || s->clients != NULL) {
+    if (txAppend(s, bytes, nbytes)) {
+      txTick(s);
+      statPut(s, bytes, nbytes);
+      return 1;
+    }
+    // Packets larger than the buffer bypass it once it has drained
+    if ((size_t) nbytes <= s->tx_cap || s->clients != NULL) {
+      statPut(s, NULL, 0);
+      return 0;
+    }
+  }
+  // Finish sending an earlier, partly written packet first
+  int count = txFlush(s) ? connWrite(s, bytes, nbytes) : 0;
+  if (count == nbytes) {
+    statPut(s, bytes, nbytes);
+    return 1;
+  }
+  else if (count > 0) {
+    // Keep the rest of the packet to send on later calls
+    txKeep(s, &bytes[count], nbytes-count);
+    statPut(s, bytes, nbytes);
+    return 1;
+  }
+  else {
+    if (count != 0 && !(count == -1 && errno == EAGAIN)) closeConnection(s);
+    statPut(s, NULL, 0);
+    return 0;
+  }
+}
+
+// Reject a batch of packets of no size, or a negative number of them
+void batchCheck(serv_socket_state_t * s, int nbytes, int npackets)
+{
+  if (nbytes <= 0 || npackets < 0) {
+    logMsg(SOCKET_LOG_ERROR, "%s socket given a batch of %d packets of %d bytes", s->name, npackets, nbytes);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Try to read up to npackets N-byte packets from socket into consecutive
+// locations of result, returning the number of packets read. At most one
+// read is issued; a trailing partial packet stays buffered for later calls.
+int socket_getN_batch(void* result, unsigned long long ptr, int nbytes, int npackets, bool server)
+{
+  serv_socket_state_t * s = socketState(ptr);
+  batchCheck(s, nbytes, npackets);
+  size_t want = (size_t) nbytes * npackets;
+  txTick(s);
+  if (rxAvailable(s) < want) {
+    rxReserve(s, want);
+    s->rx_unit = nbytes;
+    rxPoll(s, server);
+  }
+  int count = rxAvailable(s) / nbytes;
+  if (count > npackets) count = npackets;
+  memcpy(result, &s->rx_buf[s->rx_head], (size_t) count * nbytes);
+  s->rx_head += (size_t) count * nbytes;
+  statGet(s, result, (size_t) count * nbytes);
+  if (count > 0) rxDelivered(s);
+  return count;
+}
+
+// Try to write up to npackets N-byte packets from consecutive locations of
+// data to socket with a single write, returning the number of packets
+// written, including a partly written one whose rest is kept for later.
+int socket_putN_batch(unsigned long long ptr, int nbytes, int npackets, unsigned int* data, bool server)
+{
+  serv_socket_state_t * s = socketState(ptr);
+  batchCheck(s, nbytes, npackets);
+  acceptConnection(s, server);
+  if (s->conn == -1) {
+    statPut(s, NULL, 0);
+    return 0;
+  }
+  uint8_t* bytes = (uint8_t*) data;
+  if ((s->tx_combine && (size_t) nbytes <= s->tx_cap) || s->clients != NULL) {
+    int count = 0;
+    while (count < npackets && txAppend(s, &bytes[(size_t) count * nbytes], nbytes))
+      count++;
+    txTick(s);
+    statPut(s, bytes, (size_t) count * nbytes);
+    return count;
+  }
+  size_t total = (size_t) nbytes * npackets;
+  int count = txFlush(s) ? connWrite(s, bytes, total) : 0;
+  if (count <= 0) {
+    if (count != 0 && !(count == -1 && errno == EAGAIN)) closeConnection(s);
+    statPut(s, NULL, 0);
+    return 0;
+  }
+  // Keep the rest of a partly written packet to send on later calls
+  size_t done = count;
+  size_t end = ((done + nbytes - 1) / nbytes) * nbytes;
+  if (done < end) txKeep(s, &bytes[done], end-done);
+  statPut(s, bytes, end);
+  return end / nbytes;
+}
+
+// Fixed-width reads and writes of W-bit packets, for the common widths of
+// hardware interfaces. The packet size being a constant, packets already
+// in the receive buffer (or fitting in the write-combining buffer) are
+// moved with fixed-size copies, and the valid flag is returned rather than
+// stored after the packet. Other cases take the getN/putN paths.
+#define SOCKET_FIXED_WIDTH(W)                                                \
+uint8_t socket_get##W(void* result, unsigned long long ptr, bool server)    \
+{                                                                            \
+  serv_socket_state_t * s = socketState(ptr);                                \
+  if (rxAvailable(s) < W/8 || txPending(s) > 0)                              \
+    return rxGet(s, result, W/8, server) ? 1 : 0;                            \
+  if (s->rx_partial) s->stats.partial_reads++;                               \
+  s->rx_partial = false;                                                     \
+  memcpy(result, &s->rx_buf[s->rx_head], W/8);                               \
+  s->rx_head += W/8;                                                         \
+  statGet(s, result, W/8);                                                   \
+  rxDelivered(s);                                                            \
+  return 1;                                                                  \
+}                                                                            \
+                                                                             \
+uint8_t socket_put##W(unsigned long long ptr, unsigned int* data, bool server) \
+{                                                                            \
+  serv_socket_state_t * s = socketState(ptr);                                \
+  if (!s->tx_combine || s->clients != NULL || s->conn == -1 ||               \
+      s->tx_cap - s->tx_tail <= W/8 || s->tx_flush_calls > 0)                \
+    return socket_putN(ptr, W/8, data, server);                              \
+  memcpy(&s->tx_buf[s->tx_tail], data, W/8);                                 \
+  s->tx_tail += W/8;                                                         \
+  statPut(s, data, W/8);                                                     \
+  return 1;                                                                  \
+}
+
+SOCKET_FIXED_WIDTH(32)
+SOCKET_FIXED_WIDTH(64)
+SOCKET_FIXED_WIDTH(128)
+SOCKET_FIXED_WIDTH(256)
+SOCKET_FIXED_WIDTH(512)
+
+// Try to read a length-prefixed message of up to maxbytes bytes into
+// result, returning its length, or -1 if no whole message has arrived yet.
+// Non-blocking like getN: a partly received message stays buffered. A
+// message longer than maxbytes is dropped, and -1 returned.
+int socket_get_msg(void* result, unsigned long long ptr, int maxbytes, bool server)
+{
+  serv_socket_state_t * s = socketState(ptr);
+  txTick(s);
+  s->rx_unit = 0;
+  s->rx_record = 0;
+  // Discard the rest of a message that was too long
+  if (s->rx_skip > 0) {
+    if (rxAvailable(s) == 0) rxPoll(s, server);
+    size_t n = (rxAvailable(s) < s->rx_skip) ? rxAvailable(s) : s->rx_skip;
+    s->rx_head += n;
+    s->rx_skip -= n;
+    if (s->rx_skip > 0) {
+      statGet(s, NULL, 0);
+      return -1;
+    }
+  }
+  size_t len = 0;
+  int hdr = msgHeader(&s->rx_buf[s->rx_head], rxAvailable(s), &len);
+  if (hdr == 0 || (hdr > 0 && len <= (size_t) maxbytes && rxAvailable(s) < hdr + len)) {
+    rxReserve(s, (hdr == 0) ? MSG_HDR_MAX : hdr + len);
+    rxPoll(s, server);
+    hdr = msgHeader(&s->rx_buf[s->rx_head], rxAvailable(s), &len);
+  }
+  if (hdr == -1) {
+    logMsg(SOCKET_LOG_WARN, "%s socket received a malformed message, closing connection", s->name);
+    closeConnection(s);
+    s->rx_head = 0;
+    s->rx_tail = 0;
+    statGet(s, NULL, 0);
+    return -1;
+  }
+  if (hdr > 0 && len > (size_t) maxbytes) {
+    logMsg(SOCKET_LOG_WARN, "%s socket dropping a %zu byte message, longer than %d bytes",
+           s->name, len, maxbytes);
+    s->rx_head += hdr;
+    s->rx_skip = len;
+    size_t n = (rxAvailable(s) < s->rx_skip) ? rxAvailable(s) : s->rx_skip;
+    s->rx_head += n;
+    s->rx_skip -= n;
+    statGet(s, NULL, 0);
+    return -1;
+  }
+  if (hdr == 0 || rxAvailable(s) < hdr + len) {
+    s->rx_partial = rxAvailable(s) > 0;
+    statGet(s, NULL, 0);
+    return -1;
+  }
+  if (s->rx_partial) s->stats.partial_reads++;
+  s->rx_partial = false;
+  memcpy(result, &s->rx_buf[s->rx_head + hdr], len);
+  statGet(s, &s->rx_buf[s->rx_head], hdr + len);
+  s->rx_head += hdr + len;
+  rxDelivered(s);
+  return (int) len;
+}
+
+// Try to write an nbytes message, prefixed with its length. Non-blocking
+// like putN, returning 0 when no write performed.
+uint8_t socket_put_msg(unsigned long long ptr, int nbytes, unsigned int* data, bool server)
+{
+  serv_socket_state_t * s = socketState(ptr);
+  size_t total = MSG_HDR_MAX + (size_t) nbytes;
+  if (s->msg_cap < total) {
+    uint8_t* buf = (uint8_t *) realloc (s->msg_buf, total);
+    if (buf == NULL) {
+      logMsg(SOCKET_LOG_ERROR, "could not grow the message buffer for %s", s->name);
+      exit(EXIT_FAILURE);
+    }
+    s->msg_buf = buf;
+    s->msg_cap = total;
+  }
+  int hdr = 0;
+  uint32_t n = nbytes;
+  do {
+    uint8_t b = n & 0x7f;
+    n >>= 7;
+    s->msg_buf[hdr++] = b | (n ? 0x80 : 0);
+  } while (n);
+  memcpy(&s->msg_buf[hdr], data, nbytes);
+  return socket_putN(ptr, hdr + nbytes, (unsigned int *) s->msg_buf, server);
+}
+
+// Length of the delimited record of up to maxbytes bytes at the front of
+// the receive buffer, maxbytes if none ends within them, or 0 if it has
+// not all arrived yet. Bytes scanned by earlier calls are not scanned again.
+size_t rxRecord(serv_socket_state_t * s, size_t maxbytes)
+{
+  size_t avail = rxAvailable(s);
+  if (s->rx_scan_head != s->rx_head || s->rx_scan_calls != s->calls ||
+      s->rx_scan_conns != s->stats.connections) {
+    s->rx_scan = 0;
+    s->rx_scan_head = s->rx_head;
+    s->rx_scan_calls = s->calls;
+    s->rx_scan_conns = s->stats.connections;
+  }
+  size_t limit = avail < maxbytes ? avail : maxbytes;
+  if (s->rx_scan < limit)
+    s->rx_scan += delimFind(&s->rx_buf[s->rx_head + s->rx_scan], limit - s->rx_scan,
+                            s->delims, s->ndelims, s->delim_map);
+  size_t len = s->rx_scan < limit ? s->rx_scan + 1 + s->delim_trailer : maxbytes;
+  if (len > maxbytes) len = maxbytes;
+  return avail >= len ? len : 0;
+}
+
+// Try to read a record ending with one of the <name>_DELIMS delimiters,
+// and the <name>_DELIM_TRAILER bytes after it, into result, returning its
+// length, or -1 if no whole record has arrived yet. Non-blocking like
+// get_msg: a partly received record stays buffered. A record longer than
+// maxbytes is delivered in maxbytes pieces, only the last of which ends
+// with the delimiter.
+int socket_get_until(void* result, unsigned long long ptr, int maxbytes, bool server)
+{
+  serv_socket_state_t * s = socketState(ptr);
+  assert(maxbytes > 0);
+  txTick(s);
+  // Merge input from multiple clients a whole record at a time
+  s->rx_unit = 0;
+  s->rx_record = maxbytes;
+  size_t len = rxRecord(s, maxbytes);
+  if (len == 0) {
+    rxReserve(s, maxbytes);
+    rxPoll(s, server);
+    len = rxRecord(s, maxbytes);
+  }
+  if (len == 0) {
+    s->rx_partial = rxAvailable(s) > 0;
+    statGet(s, NULL, 0);
+    s->rx_scan_calls = s->calls;
+    return -1;
+  }
+  if (s->rx_partial) s->stats.partial_reads++;
+  s->rx_partial = false;
+  memcpy(result, &s->rx_buf[s->rx_head], len);
+  statGet(s, &s->rx_buf[s->rx_head], len);
+  s->rx_head += len;
+  rxDelivered(s);
+  return (int) len;
+}
+
+// Create an empty poll set
+unsigned long long socket_poll_create(void)
+{
+  socket_poll_set_t * p = (socket_poll_set_t *) malloc (sizeof(socket_poll_set_t));
+  if (p == NULL) {
+    logMsg(SOCKET_LOG_ERROR, "could not allocate poll set");
+    exit(EXIT_FAILURE);
+  }
+  p->n = 0;
+#ifdef __linux__
+  p->epfd = epoll_create1(0);
+  if (p->epfd == -1) {
+    logMsg(SOCKET_LOG_ERROR, "could not create a poll set: %s", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+#endif
+  return (unsigned long long) p;
+}
+
+// Add a socket to a poll set, returning its index in the poll results
+int socket_poll_add(unsigned long long set, unsigned long long ptr, bool server)
+{
+  socket_poll_set_t * p = (socket_poll_set_t *) set;
+  serv_socket_state_t * s = socketState(ptr);
+  // Reuse the index of a socket destroyed since
+  int i = 0;
+  while (i < p->n && p->states[i] != NULL) i++;
+  if (i == POLL_SET_MAX) {
+    logMsg(SOCKET_LOG_ERROR, "too many sockets in poll set, adding %s", s->name);
+    exit(EXIT_FAILURE);
+  }
+  if (s->poll_set != NULL) {
+    logMsg(SOCKET_LOG_ERROR, "socket %s is already in a poll set", s->name);
+    exit(EXIT_FAILURE);
+  }
+  socket_init(ptr, server);
+  s->poll_set = p;
+  s->poll_ready = true;
+  if (s->clients != NULL) {
+    if (s->nclients < s->max_clients) pollSetWatch(s, s->sock);
+    for (int i = 0; i < s->nclients; i++) pollSetWatch(s, s->clients[i].fd);
+  } else pollSetWatch(s, (s->conn != -1) ? s->conn : s->sock);
+  p->states[i] = s;
+  if (i == p->n) p->n++;
+  return i;
+}
+
+// Check all the sockets of a poll set with one system call, returning a
+// mask with bit i set if the socket of index i has a pending connection or
+// data. Sockets not reported ready are not accessed again until next poll.
+uint64_t socket_poll(unsigned long long set)
+{
+  socket_poll_set_t * p = (socket_poll_set_t *) set;
+  // Sockets with readable file descriptors
+  uint64_t seen = 0;
+#ifdef __linux__
+  struct epoll_event evs[2*POLL_SET_MAX];
+  int n = epoll_wait(p->epfd, evs, 2*POLL_SET_MAX, 0);
+  for (int k = 0; k < n; k++)
+    for (int i = 0; i < p->n; i++)
+      if (p->states[i] == evs[k].data.ptr) seen |= 1ull << i;
+#else
+  struct pollfd fds[POLL_SET_MAX];
+  for (int i = 0; i < p->n; i++) {
+    serv_socket_state_t * s = p->states[i];
+    fds[i].fd = (s == NULL || ringTransport(s)) ? -1 : (s->conn != -1) ? s->conn : s->sock;
+    fds[i].events = POLLIN;
+    fds[i].revents = 0;
+  }
+  poll(fds, p->n, 0);
+  for (int i = 0; i < p->n; i++)
+    if (fds[i].revents) seen |= 1ull << i;
+#endif
+  uint64_t mask = 0;
+  for (int i = 0; i < p->n; i++) {
+    if (p->states[i] == NULL) continue;
+    serv_socket_state_t * s = socketLock(p->states[i]->handle);
+    s->poll_ready = (seen >> i) & 1;
+    if (ringTransport(s) && ringAvailable(&s->ring_rx) > 0) s->poll_ready = true;
+    if (s->ur != NULL) {
+      // io_uring takes the data out of the kernel, so the ring has the say
+      if (uringReady(s)) s->poll_ready = true;
+      else uringArm(s);
+    }
+    if (s->replay != NULL || (s->peer_len != 0 && s->conn == -1)) s->poll_ready = true;
+    if (s->poll_ready || rxAvailable(s) > 0) mask |= 1ull << i;
+    socketUnlock(s);
+  }
+  return mask;
+}
+
+// Stop watching s in its poll set, freeing its index for another socket
+void pollSetRemove(serv_socket_state_t * s)
+{
+  socket_poll_set_t * p = s->poll_set;
+  for (int i = 0; i < s->nclients; i++) pollSetUnwatch(s, s->clients[i].fd);
+  if (s->sock != -1) pollSetUnwatch(s, s->sock);
+  if (s->conn != -1 && s->conn != s->sock) pollSetUnwatch(s, s->conn);
+  for (int i = 0; i < p->n; i++)
+    if (p->states[i] == s) p->states[i] = NULL;
+  while (p->n > 0 && p->states[p->n - 1] == NULL) p->n--;
+  s->poll_set = NULL;
+}
+
+// Take a socket out of a poll set, freeing its index for another socket
+void socket_poll_remove(unsigned long long set, unsigned long long ptr)
+{
+  socket_poll_set_t * p = (socket_poll_set_t *) set;
+  serv_socket_state_t * s = socketState(ptr);
+  if (s->poll_set != p) {
+    logMsg(SOCKET_LOG_ERROR, "socket %s is not in this poll set", s->name);
+    exit(EXIT_FAILURE);
+  }
+  pollSetRemove(s);
+}
+
+// Take all the sockets out of a poll set and free it
+void socket_poll_destroy(unsigned long long set)
+{
+  socket_poll_set_t * p = (socket_poll_set_t *) set;
+  while (p->n > 0) {
+    serv_socket_state_t * s = socketLock(p->states[p->n - 1]->handle);
+    pollSetRemove(s);
+    socketUnlock(s);
+  }
+#ifdef __linux__
+  close(p->epfd);
+#endif
+  free(p);
+}
+
+// Whether a get on s would find data without waiting: input buffered or
+// in its ring, input buffered for one of its clients, or a replayed trace
+bool socketReady(serv_socket_state_t * s)
+{
+  if (rxAvailable(s) > 0 || s->replay != NULL) return true;
+  if (ringTransport(s) && ringAvailable(&s->ring_rx) > 0) return true;
+  if (s->ur != NULL && uringReady(s)) return true;
+  for (int i = 0; i < s->nclients; i++)
+    if (s->clients[i].rx_tail > s->clients[i].rx_head) return true;
+  return false;
+}
+
+// Block until one of n sockets has a pending connection or data, for up to
+// timeout_us (forever if negative, rounded up to milliseconds), returning
+// its index in handles, or -1 on timeout. Sockets without a file
+// descriptor to sleep on (shared memory or I/O thread rings) sleep on the
+// ring's futex when alone, and are checked every millisecond otherwise.
+int socket_wait_any(unsigned long long * handles, int n, int64_t timeout_us, bool server)
+{
+  if (n <= 0) return -1;
+  uint64_t start = monotonicNs();
+  uint64_t deadline = timeout_us < 0 ? UINT64_MAX : start + (uint64_t) timeout_us * 1000ull;
+  struct pollfd local_fds[WAIT_LOCAL_FDS];
+  int local_idx[WAIT_LOCAL_FDS];
+  struct pollfd * fds = local_fds;
+  int * idx = local_idx;
+  int cap = WAIT_LOCAL_FDS;
+  int ready = -1;
+  for (;;) {
+    int nfds = 0;
+    int nrings = 0;
+    int nuring = 0;
+    serv_socket_state_t * ring = NULL;
+    uint64_t wake = deadline;
+    for (int i = 0; i < n && ready == -1; i++) {
+      serv_socket_state_t * s = socketLock(handles[i]);
+      if (s->sock == -1 && s->peer_len == 0) socket_init(handles[i], server);
+      // Move client connections along
+      if (s->peer_len != 0 && s->conn == -1) acceptConnection(s, server);
+      if (socketReady(s)) ready = i;
+      else if (ringTransport(s)) {
+        nrings++;
+        ring = s;
+      } else if (s->peer_len != 0 && s->sock == -1) {
+        // Client waiting to reconnect
+        if (s->reconnect_ns < wake) wake = s->reconnect_ns;
+      } else if (s->ur != NULL && !s->connecting && s->sock != -1) {
+        // Woken up through the shared io_uring
+        uringArm(s);
+        nuring++;
+      } else {
+        // Leaving room for the io_uring file descriptor
+        if (nfds + 2 + s->nclients > cap) {
+          cap = 2 * (nfds + 1 + s->nclients);
+          struct pollfd * f = (struct pollfd *) malloc (cap * sizeof(struct pollfd));
+          int * x = (int *) malloc (cap * sizeof(int));
+          if (f == NULL || x == NULL) {
+            logMsg(SOCKET_LOG_ERROR, "could not allocate the poll list waiting on %s", s->name);
+            exit(EXIT_FAILURE);
+          }
+          memcpy(f, fds, nfds * sizeof(struct pollfd));
+          memcpy(x, idx, nfds * sizeof(int));
+          if (fds != local_fds) {
+            free(fds);
+            free(idx);
+          }
+          fds = f;
+          idx = x;
+        }
+        short events = s->connecting ? POLLOUT : POLLIN;
+        if (s->clients != NULL) {
+          if (s->nclients < s->max_clients) {
+            fds[nfds].fd = s->sock;
+            idx[nfds++] = i;
+          }
+          for (int j = 0; j < s->nclients; j++)
+            if (s->clients[j].fd != -1) {
+              fds[nfds].fd = s->clients[j].fd;
+              idx[nfds++] = i;
+            }
+        } else {
+          fds[nfds].fd = (s->conn != -1) ? s->conn : s->sock;
+          idx[nfds++] = i;
+        }
+        for (int j = nfds - 1; j >= 0 && idx[j] == i; j--) {
+          fds[j].events = events;
+          fds[j].revents = 0;
+        }
+      }
+      socketUnlock(s);
+    }
+    if (ready != -1) break;
+    if (nuring > 0) {
+      uringSubmit(false, 0);
+      fds[nfds].fd = uringFd();
+      fds[nfds].events = POLLIN;
+      fds[nfds].revents = 0;
+      idx[nfds++] = -1;
+    }
+
+    uint64_t now = monotonicNs();
+    int timeout_ms = wake == UINT64_MAX ? -1 : now >= wake ? 0 : (int) ((wake - now + 999999) / 1000000);
+    if (nrings == 1 && nfds == 0) ringWait(&ring->ring_rx, false, timeout_ms);
+    else {
+      if (nrings > 0 && (timeout_ms < 0 || timeout_ms > 1)) timeout_ms = 1;
+      int res = poll(fds, nfds, timeout_ms);
+      assert(res >= 0 || errno == EINTR);
+      for (int j = 0; j < nfds && res > 0 && ready == -1; j++) {
+        // Completions on the io_uring are looked at by the next round
+        if (fds[j].revents == 0 || idx[j] == -1) continue;
+        serv_socket_state_t * s = socketLock(handles[idx[j]]);
+        // A completed connect is not data yet
+        if (!s->connecting) ready = idx[j];
+        socketUnlock(s);
+      }
+    }
+    if (ready != -1 || monotonicNs() >= deadline) break;
+  }
+
+  if (fds != local_fds) {
+    free(fds);
+    free(idx);
+  }
+  if (ready != -1) {
+    // Have the next get look, even if backing off or not polled ready
+    serv_socket_state_t * s = socketLock(handles[ready]);
+    s->poll_ready = true;
+    backoffReset(s);
+    socketUnlock(s);
+  }
+  return ready;
+}
+
+// Non-blocking flush of the write-combining buffer, returning 1 when no
+// data is left pending
+uint8_t socket_flush(unsigned long long ptr, bool server)
+{
+  serv_socket_state_t * s = socketState(ptr);
+  acceptConnection(s, server);
+  bool done = txFlush(s);
+  if (s->ur != NULL) uringSubmit(false, 0);
+  return done ? 1 : 0;
+}
+
+// Note the current simulation cycle, to measure latencies in cycles too
+void socket_set_cycle(unsigned long long ptr, uint64_t cycle)
+{
+  serv_socket_state_t * s = socketState(ptr);
+  if (s->lat == NULL) return;
+  s->lat->cycle = cycle;
+  s->lat->cycles = true;
+}
+
+// Summary of latency histogram which (a SOCKET_LATENCY_* index), all
+// zeros unless <name>_LATENCY is set
+void socket_get_latency(unsigned long long ptr, int which, socket_latency_stats_t* stats)
+{
+  serv_socket_state_t * s = socketState(ptr);
+  if (s->lat == NULL || which < 0 || which > 3) memset(stats, 0, sizeof(*stats));
+  else latSummary(&s->lat->hist[which], stats);
+}
+
+// Bulk transfers
+////////////////////////////////////////////////////////////////////////////////
+
+// A bulk transfer is sent in-band as a bulk_header_t followed by either
+// the contents of a file (BULK_DATA) or, when both ends share a file
+// system, just its absolute path (BULK_PATH) for the receiver to map
+typedef struct {
+  uint32_t magic;
+  uint32_t kind;
+  uint64_t size;
+} bulk_header_t;
+
+// Account for a bulk transfer of the header and the nbytes at data that
+// follow it, going in direction dir, as a get or put of them would be,
+// latency aside. Both are captured as records of the one call, for a replay
+// to take them in together.
+void statBulk(serv_socket_state_t * s, uint32_t dir, const bulk_header_t * hdr, const void * data, size_t nbytes)
+{
+  if (dir == TRACE_GET) {
+    s->stats.reads++;
+    s->stats.bytes_in += sizeof(*hdr) + nbytes;
+  } else {
+    s->stats.writes++;
+    s->stats.bytes_out += sizeof(*hdr) + nbytes;
+    backoffReset(s);
+  }
+  if (s->capture != NULL) {
+    traceAppend(s->capture, s->calls, dir, hdr, sizeof(*hdr));
+    if (nbytes > 0) traceAppend(s->capture, s->calls, dir, data, nbytes);
+  }
+  s->calls++;
+}
+
+// Wait for up to timeout_ms for a client or I/O thread still connecting to
+// get further: for the connection to complete or the next attempt to be
+// due. An I/O thread gives no notice of connecting, so is looked at again
+// every millisecond.
+void connectWait(serv_socket_state_t * s, int timeout_ms)
+{
+  struct pollfd pfd;
+  pfd.fd = s->sock;
+  pfd.events = POLLOUT;
+  if (s->io != NULL) {
+    if (timeout_ms > 1) timeout_ms = 1;
+    poll(NULL, 0, timeout_ms);
+  } else if (s->connecting) poll(&pfd, 1, timeout_ms);
+  else if (s->sock == -1) {
+    uint64_t now = monotonicNs();
+    uint64_t ms = s->reconnect_ns > now ? (s->reconnect_ns - now + 999999) / 1000000 : 0;
+    poll(NULL, 0, ms < (uint64_t) timeout_ms ? (int) ms : timeout_ms);
+  }
+}
+
+// Blocking write of nbytes to the connection, returning false if it closed
+bool connWriteAll(serv_socket_state_t * s, const void * buf, size_t nbytes)
+{
+  const uint8_t * bytes = (const uint8_t *) buf;
+  while (nbytes > 0) {
+    if (s->conn == -1) return false;
+    int n = connWrite(s, bytes, nbytes);
+    if (n > 0) {
+      bytes += n;
+      nbytes -= n;
+    } else if (n == -1 && errno == EAGAIN) connWait(s, true, -1);
+    else {
+      closeConnection(s);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Blocking transfer of a file to the other end. Anything queued before is
+// sent first. Returns 0 on success or -1 on failure.
+int socket_bulk_send(unsigned long long ptr, const char * file, bool server)
+{
+  serv_socket_state_t * s = socketState(ptr);
+  if (s->clients != NULL) {
+    logMsg(SOCKET_LOG_WARN, "%s socket cannot send bulk transfers in multi-client mode", s->name);
+    return -1;
+  }
+  acceptConnection(s, server);
+  // An I/O thread or client may still be connecting
+  uint64_t deadline = monotonicNs() + (uint64_t) s->put_timeout_ms * 1000000ull;
+  uint64_t now;
+  while (s->conn == -1 && (s->io != NULL || s->peer_len != 0) && (now = monotonicNs()) < deadline) {
+    connectWait(s, (int) ((deadline - now + 999999) / 1000000));
+    acceptConnection(s, server);
+  }
+  while (s->conn != -1 && !txFlush(s)) connWait(s, true, -1);
+  if (s->conn == -1) return -1;
+  int fd = open(file, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    logMsg(SOCKET_LOG_WARN, "%s socket could not open %s for a bulk transfer: %s",
+           s->name, file, strerror(errno));
+    if (fd != -1) close(fd);
+    return -1;
+  }
+  bulk_header_t hdr;
+  hdr.magic = BULK_MAGIC;
+  char path[PATH_MAX];
+  if (getSocketEnvInt(s->name, "BULK_BY_PATH", !sockIsRemote(s->io != NULL ? s->io->worker->conn : s->conn)) != 0 && realpath(file, path) != NULL) {
+    close(fd);
+    hdr.kind = BULK_PATH;
+    hdr.size = strlen(path);
+    if (!connWriteAll(s, &hdr, sizeof(hdr)) || !connWriteAll(s, path, hdr.size)) return -1;
+    statBulk(s, TRACE_PUT, &hdr, path, hdr.size);
+    return 0;
+  }
+  hdr.kind = BULK_DATA;
+  hdr.size = st.st_size;
+  if (!connWriteAll(s, &hdr, sizeof(hdr))) {
+    close(fd);
+    return -1;
+  }
+  // Send the contents with sendfile(2) on Linux sockets, through a buffer
+  // on rings, with io_uring, when replaying and elsewhere
+  off_t off = 0;
+  uint8_t* chunk = NULL;
+  while ((uint64_t) off < hdr.size) {
+    ssize_t n = 0;
+#ifdef __linux__
+    if (!ringTransport(s) && s->ur == NULL && s->replay == NULL && chunk == NULL) {
+      n = sendfile(s->conn, fd, &off, hdr.size - off);
+      if (n == -1 && errno == EAGAIN) {
+        connWait(s, true, -1);
+        continue;
+      }
+      // Fall back to copying where sendfile(2) is not supported
+      if (n == -1 && (errno == EINVAL || errno == ENOSYS)) n = 0;
+      else if (n < 0) {
+        closeConnection(s);
+        break;
+      }
+    }
+#endif
+    if (n == 0) {
+      if (chunk == NULL && (chunk = (uint8_t *) malloc (BULK_CHUNK_SZ)) == NULL) {
+        logMsg(SOCKET_LOG_ERROR, "could not allocate the bulk transfer buffer for %s", s->name);
+        exit(EXIT_FAILURE);
+      }
+      n = pread(fd, chunk, BULK_CHUNK_SZ, off);
+      if (n <= 0 || !connWriteAll(s, chunk, n)) break;
+      off += n;
+    }
+  }
+  free(chunk);
+  if ((uint64_t) off < hdr.size) {
+    close(fd);
+    logMsg(SOCKET_LOG_WARN, "%s socket bulk transfer of %s failed", s->name, file);
+    return -1;
+  }
+  // Captured from a mapping of the file, whichever way it was sent
+  void* data = NULL;
+  if (s->capture != NULL && hdr.size > 0) {
+    data = mmap(NULL, hdr.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      logMsg(SOCKET_LOG_ERROR, "could not map %s to capture its bulk transfer: %s", file, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+  close(fd);
+  statBulk(s, TRACE_PUT, &hdr, data, data != NULL ? hdr.size : 0);
+  if (data != NULL) munmap(data, hdr.size);
+  return 0;
+}
+
+// Whether s maps the files a peer names: only when every peer is on this
+// machine, unless <name>_BULK_ACCEPT_PATH says otherwise
+bool bulkPathAllowed(serv_socket_state_t * s)
+{
+  bool remote = false;
+  if (s->clients != NULL)
+    for (int i = 0; i < s->nclients; i++) remote = remote || sockIsRemote(s->clients[i].fd);
+  else remote = sockIsRemote(s->io != NULL ? s->io->worker->conn : s->conn);
+  return getSocketEnvInt(s->name, "BULK_ACCEPT_PATH", !remote) != 0;
+}
+
+// Drop the connection of s after a bad bulk transfer
+int bulkReject(serv_socket_state_t * s, const char * why)
+{
+  logMsg(SOCKET_LOG_WARN, "%s socket %s, closing connection", s->name, why);
+  closeConnection(s);
+  s->rx_head = 0;
+  s->rx_tail = 0;
+  return -1;
+}
+
+// Non-blocking receipt of a bulk transfer, returning 1 once one is
+// complete, 0 while waiting for (the rest of) one, or -1 on failure. A
+// completed transfer stays available until released.
+int socket_bulk_recv(unsigned long long ptr, bool server)
+{
+  serv_socket_state_t * s = socketState(ptr);
+  if (s->clients != NULL) {
+    logMsg(SOCKET_LOG_WARN, "%s socket cannot receive bulk transfers in multi-client mode", s->name);
+    return -1;
+  }
+  if (s->bulk_active && s->bulk_got == s->bulk_size) return 1;
+  txTick(s);
+  if (!s->bulk_active) {
+    bulk_header_t hdr;
+    if (rxAvailable(s) < sizeof(hdr)) {
+      rxReserve(s, sizeof(hdr));
+      rxPoll(s, server);
+      if (rxAvailable(s) < sizeof(hdr)) return 0;
+    }
+    memcpy(&hdr, &s->rx_buf[s->rx_head], sizeof(hdr));
+    if (hdr.magic != BULK_MAGIC || (hdr.kind == BULK_PATH && hdr.size >= PATH_MAX))
+      return bulkReject(s, "received a malformed bulk transfer");
+    if (hdr.kind == BULK_PATH && !bulkPathAllowed(s))
+      return bulkReject(s, "refused a bulk transfer by path");
+    if (hdr.kind == BULK_PATH) {
+      // Map the file the path names
+      if (rxAvailable(s) < sizeof(hdr) + hdr.size) {
+        rxReserve(s, sizeof(hdr) + hdr.size);
+        rxPoll(s, server);
+        if (rxAvailable(s) < sizeof(hdr) + hdr.size) return 0;
+      }
+      char path[PATH_MAX];
+      memcpy(path, &s->rx_buf[s->rx_head + sizeof(hdr)], hdr.size);
+      path[hdr.size] = '\0';
+      s->rx_head += sizeof(hdr) + hdr.size;
+      statBulk(s, TRACE_GET, &hdr, path, hdr.size);
+      int fd = open(path, O_RDONLY);
+      struct stat st;
+      if (fd == -1 || fstat(fd, &st) == -1) {
+        logMsg(SOCKET_LOG_WARN, "%s socket could not open bulk transfer %s: %s",
+               s->name, path, strerror(errno));
+        if (fd != -1) close(fd);
+        return -1;
+      }
+      if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        logMsg(SOCKET_LOG_WARN, "%s socket refused bulk transfer %s, not a regular file", s->name, path);
+        return -1;
+      }
+      s->bulk_size = st.st_size;
+      s->bulk_data = NULL;
+      if (s->bulk_size > 0) {
+        s->bulk_data = (uint8_t *) mmap(NULL, s->bulk_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (s->bulk_data == MAP_FAILED) {
+          logMsg(SOCKET_LOG_WARN, "%s socket could not map bulk transfer %s: %s",
+                 s->name, path, strerror(errno));
+          close(fd);
+          return -1;
+        }
+      }
+      close(fd);
+      s->bulk_mapped = true;
+      s->bulk_got = s->bulk_size;
+    } else {
+      // Receive the contents into an anonymous mapping
+      s->rx_head += sizeof(hdr);
+      s->bulk_size = hdr.size;
+      s->bulk_data = NULL;
+      if (s->bulk_size > 0) {
+        s->bulk_data = (uint8_t *) mmap(NULL, s->bulk_size, PROT_READ|PROT_WRITE,
+                                        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (s->bulk_data == MAP_FAILED) {
+          s->bulk_data = NULL;
+          return bulkReject(s, "could not allocate a bulk transfer of the size received");
+        }
+      }
+      s->bulk_mapped = false;
+      s->bulk_got = 0;
+    }
+    s->bulk_active = true;
+  }
+  // Take what has already been buffered, then read the rest straight into
+  // place, except in multi-client mode where input is merged through the
+  // receive buffer
+  while (s->bulk_got < s->bulk_size) {
+    if (rxAvailable(s) > 0) {
+      size_t n = rxAvailable(s);
+      if (n > s->bulk_size - s->bulk_got) n = s->bulk_size - s->bulk_got;
+      memcpy(&s->bulk_data[s->bulk_got], &s->rx_buf[s->rx_head], n);
+      s->rx_head += n;
+      s->bulk_got += n;
+      continue;
+    }
+    if (s->conn == -1) break;
+    if (s->clients != NULL) {
+      if (rxFill(s) == 0) break;
+      continue;
+    }
+    int n = connRead(s, &s->bulk_data[s->bulk_got], s->bulk_size - s->bulk_got);
+    if (n > 0) s->bulk_got += n;
+    else {
+      if (!(n == -1 && errno == EAGAIN)) closeConnection(s);
+      break;
+    }
+  }
+  if (s->bulk_got < s->bulk_size) {
+    if (s->conn != -1) return 0;
+    logMsg(SOCKET_LOG_WARN, "%s socket lost the connection during a bulk transfer", s->name);
+    munmap(s->bulk_data, s->bulk_size);
+    s->bulk_active = false;
+    return -1;
+  }
+  if (!s->bulk_mapped) {
+    bulk_header_t hdr;
+    hdr.magic = BULK_MAGIC;
+    hdr.kind = BULK_DATA;
+    hdr.size = s->bulk_size;
+    statBulk(s, TRACE_GET, &hdr, s->bulk_data, s->bulk_size);
+  }
+  return 1;
+}
+
+// Release the data of a completed bulk transfer
+void socket_bulk_release(unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketState(ptr);
+  if (!s->bulk_active) return;
+  if (s->bulk_data != NULL) munmap(s->bulk_data, s->bulk_size);
+  s->bulk_data = NULL;
+  s->bulk_size = 0;
+  s->bulk_got = 0;
+  s->bulk_active = false;
+}
+
+// Background I/O threads
+////////////////////////////////////////////////////////////////////////////////
+
+// Move data between the worker socket and the rings until asked to stop,
+// sleeping in poll(2) whenever there is nothing to do
+void* ioThreadMain(void * arg)
+{
+  serv_socket_state_t * s = (serv_socket_state_t *) arg;
+  io_thread_t * io = s->io;
+  serv_socket_state_t * w = io->worker;
+  while (!atomic_load_explicit(&io->stop, memory_order_relaxed)) {
+    bool busy = false;
+    acceptConnection(w, io->server);
+    atomic_store_explicit(&io->connected, w->conn != -1, memory_order_release);
+
+    // Socket to simulator
+    if (rxAvailable(w) == 0) rxFill(w);
+    if (rxAvailable(w) > 0) {
+      uint32_t n = ringWrite(&io->ring_rx, &w->rx_buf[w->rx_head], rxAvailable(w));
+      w->rx_head += n;
+      busy |= n > 0;
+    }
+
+    // Simulator to socket
+    if (w->conn != -1) {
+      if (txPending(w) == 0) {
+        w->tx_head = 0;
+        w->tx_tail = ringRead(&io->ring_tx, w->tx_buf, w->tx_cap);
+      }
+      if (txPending(w) > 0) {
+        size_t before = txPending(w);
+        txFlush(w);
+        busy |= txPending(w) < before;
+      }
+    } else if (ringAvailable(&io->ring_tx) > 0) {
+      // Nobody to send to, drop the data like a closed connection would
+      uint8_t discard[256];
+      while (ringRead(&io->ring_tx, discard, sizeof(discard)) > 0);
+    }
+    if (busy) continue;
+
+    // Sleep until the socket or the simulator side has something for us
+    bool rx_full = rxAvailable(w) > 0;
+    atomic_store_explicit(&io->ring_rx.idx->head_waiting, rx_full, memory_order_relaxed);
+    atomic_store_explicit(&io->ring_tx.idx->tail_waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (ringAvailable(&io->ring_tx) == 0 &&
+        (!rx_full || ringAvailable(&io->ring_rx) == io->ring_rx.size)) {
+      struct pollfd fds[2];
+      fds[0].fd = (w->conn != -1) ? w->conn : w->sock;
+      fds[0].events = (rx_full ? 0 : POLLIN) | (txPending(w) > 0 || w->connecting ? POLLOUT : 0);
+      fds[1].fd = io->wake[0];
+      fds[1].events = POLLIN;
+      poll(fds, 2, 100);
+      uint8_t tokens[64];
+      while (read(io->wake[0], tokens, sizeof(tokens)) > 0);
+    }
+    atomic_store_explicit(&io->ring_rx.idx->head_waiting, 0, memory_order_relaxed);
+    atomic_store_explicit(&io->ring_tx.idx->tail_waiting, 0, memory_order_relaxed);
+  }
+  return NULL;
+}
+
+// Start the I/O thread of s, which gets a private worker state to operate
+// the actual socket with
+void ioThreadStart(serv_socket_state_t * s, bool server)
+{
+  io_thread_t * io = (io_thread_t *) malloc (sizeof(io_thread_t));
+  if (io == NULL || pipe(io->wake) == -1) {
+    logMsg(SOCKET_LOG_ERROR, "could not set up the I/O thread for %s", s->name);
+    exit(EXIT_FAILURE);
+  }
+  socketSetNonBlocking(io->wake[0]);
+  socketSetNonBlocking(io->wake[1]);
+  io->server = server;
+  atomic_init(&io->connected, false);
+  atomic_init(&io->stop, false);
+
+  io->worker = socketState(socketCreate(s->name, s->port, true));
+  socket_init(io->worker->handle, server);
+  if (io->worker->tx_buf == NULL) {
+    io->worker->tx_buf = (uint8_t *) malloc (RX_BUFF_SZ);
+    if (io->worker->tx_buf == NULL) {
+      logMsg(SOCKET_LOG_ERROR, "could not allocate the I/O thread buffer for %s", s->name);
+      exit(EXIT_FAILURE);
+    }
+    io->worker->tx_cap = RX_BUFF_SZ;
+  }
+
+  // The simulator wakes the thread through the pipe, the thread wakes the
+  // simulator through futexes
+  long sz = getSocketEnvInt(s->name, "IO_RING_SIZE", DFLT_SHM_RING_SZ);
+  ringAlloc(&s->ring_rx, sz);
+  ringAlloc(&s->ring_tx, sz);
+  s->ring_rx.wake_fd = io->wake[1];
+  s->ring_tx.wake_fd = io->wake[1];
+  io->ring_rx = s->ring_rx;
+  io->ring_tx = s->ring_tx;
+  io->ring_rx.wake_fd = -1;
+  io->ring_tx.wake_fd = -1;
+
+  s->io = io;
+  s->sock = io->wake[0];
+  if (pthread_create(&io->tid, NULL, ioThreadMain, s) != 0) {
+    logMsg(SOCKET_LOG_ERROR, "could not start the I/O thread for %s", s->name);
+    exit(EXIT_FAILURE);
+  }
+  logMsg(SOCKET_LOG_INFO, "%s socket serviced by a background I/O thread", s->name);
+}
+
+// Teardown
+////////////////////////////////////////////////////////////////////////////////
+
+// Write out everything pending, waiting until the deadline at most.
+// Returns true when nothing was left pending.
+bool txDrain(serv_socket_state_t * s, uint64_t deadline)
+{
+  while (!txFlush(s)) {
+    uint64_t now = monotonicNs();
+    if (s->conn == -1 || now >= deadline) return false;
+    connWait(s, true, (int) ((deadline - now + 999999) / 1000000));
+  }
+  // which the io_uring backend may still be sending
+  while (s->ur != NULL && s->conn != -1 && uringSending(s)) {
+    uint64_t now = monotonicNs();
+    if (now >= deadline) return false;
+    connWait(s, true, (int) ((deadline - now + 999999) / 1000000));
+  }
+  if (s->io == NULL) return true;
+  // Then wait for the I/O thread to take it all from the ring
+  while (ringAvailable(&s->ring_tx) > 0) {
+    if (monotonicNs() >= deadline) return false;
+    usleep(1000);
+  }
+  return true;
+}
+
+void socketDestroy(serv_socket_state_t * s, bool server);
+
+// Stop the I/O thread of s and destroy its worker state, first letting it
+// write out what it holds when flushing
+void ioThreadStop(serv_socket_state_t * s, uint64_t deadline, bool flush)
+{
+  io_thread_t * io = s->io;
+  atomic_store_explicit(&io->stop, true, memory_order_relaxed);
+  uint8_t token = 0;
+  if (write(io->wake[1], &token, 1) == -1 && errno != EAGAIN)
+    logMsg(SOCKET_LOG_ERROR, "could not wake the I/O thread of %s: %s", s->name, strerror(errno));
+  pthread_join(io->tid, NULL);
+  if (flush && io->worker->conn != -1 && !txDrain(io->worker, deadline))
+    logMsg(SOCKET_LOG_WARN, "%s socket dropped unsent data at close", s->name);
+  socketDestroy(socketLock(io->worker->handle), io->server);
+  close(io->wake[0]);
+  close(io->wake[1]);
+  free(s->ring_rx.idx);
+  free(s->ring_rx.data);
+  free(s->ring_tx.idx);
+  free(s->ring_tx.data);
+  free(io);
+  s->io = NULL;
+  s->sock = -1;
+  s->conn = -1;
+}
+
+// Close the file descriptors of s, free its buffers and release its
+// handle. A server also removes its unix domain socket path or shared
+// memory object, unless <name>_UNLINK is 0. In thread-safe mode, s is
+// locked by the caller and its lock goes with it.
+void socketDestroy(serv_socket_state_t * s, bool server)
+{
+  if (s->io != NULL) ioThreadStop(s, 0, false);
+  if (s->poll_set != NULL) pollSetRemove(s);
+  if (s->stats_dump) statDump(s);
+  if (s->ur != NULL) uringDestroy(s);
+  if (s->clients != NULL) {
+    for (int i = 0; i < s->max_clients; i++) {
+      if (i < s->nclients && s->clients[i].fd != -1) close(s->clients[i].fd);
+      free(s->clients[i].rx_buf);
+    }
+    free(s->clients);
+  } else if (s->conn != -1 && s->conn != s->sock) close(s->conn);
+  if (s->replay != NULL) traceClose(s->replay, false);
+  else if (s->sock != -1) close(s->sock);
+  if (s->capture != NULL) traceClose(s->capture, true);
+  if (s->shm != NULL) munmap(s->shm, s->shm_sz);
+  if (s->bulk_active && s->bulk_data != NULL) munmap(s->bulk_data, s->bulk_size);
+  bool unlink_path = server && getSocketEnvInt(s->name, "UNLINK", 1) != 0;
+  if (unlink_path && s->path[0] != '\0' && s->sock != -1) unlink(s->path);
+  if (unlink_path && s->shm_obj[0] != '\0') shm_unlink(s->shm_obj);
+  free(s->rx_buf);
+  free(s->tx_buf);
+  free(s->msg_buf);
+  free(s->lat);
+  free(s->peers);
+  if (s->lock != NULL) {
+    pthread_mutex_unlock(s->lock);
+    pthread_mutex_destroy(s->lock);
+    free(s->lock);
+  }
+  if (!s->io_worker) logMsg(SOCKET_LOG_INFO, "%s socket closed", s->name);
+  socketRelease(s);
+}
+
+// Close a socket, first giving pending writes up to put_timeout_ms to go
+// out when flushing, or dropping them otherwise
+void socket_close(unsigned long long ptr, bool server, bool flush)
+{
+  serv_socket_state_t * s = socketState(ptr);
+  uint64_t deadline = monotonicNs() + (uint64_t) s->put_timeout_ms * 1000000ull;
+  if (flush && s->conn != -1 && !txDrain(s, deadline))
+    logMsg(SOCKET_LOG_WARN, "%s socket dropped unsent data at close", s->name);
+  if (s->io != NULL) ioThreadStop(s, deadline, flush);
+  socketDestroy(s, server);
+}
+
+// Logging API implementation
+////////////////////////////////////////////////////////////////////////////////
+void socket_packet_set_log_level(int level)
+{
+  atomic_store_explicit(&log_level, level < SOCKET_LOG_NONE ? SOCKET_LOG_NONE : level, memory_order_relaxed);
+}
+
+void socket_packet_set_log_handler(socket_packet_log_fn fn, void* arg)
+{
+  log_arg = arg;
+  log_fn = fn;
+}
+
+// serv_socket API implementation
+////////////////////////////////////////////////////////////////////////////////
+unsigned long long serv_socket_create(const char * name, unsigned int dflt_port)
+{
+  return socket_create(name, dflt_port);
+}
+
+// A wrapper for systems that don't allow passing strings (verilator?)
+unsigned long long serv_socket_create_nameless(unsigned int dflt_port)
+{
+  char* s = getenv(ENV_DFLT_SOCKET_NAME);
+  if (s != NULL) return serv_socket_create(s, dflt_port);
+  else {
+    logMsg(SOCKET_LOG_INFO, ENV_DFLT_SOCKET_NAME " environment variable not defined, "
+           "using default socket name %s instead", DFLT_SOCKET_NAME);
+    return serv_socket_create(DFLT_SOCKET_NAME, dflt_port);
+  }
+}
+
+// Open, bind and listen
+extern void serv_socket_init(unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  socket_init(ptr, true);
+  socketUnlock(s);
+}
+
+// Non-blocking read of 8 bits
+uint32_t serv_socket_get8(unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  uint32_t r = socket_get8(ptr, true);
+  socketUnlock(s);
+  return r;
+}
+
+// Non-blocking write of 8 bits
+uint8_t serv_socket_put8(unsigned long long ptr, uint8_t byte)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  uint8_t r = socket_put8(ptr, byte, true);
+  socketUnlock(s);
+  return r;
+}
+
+// Blocking write of 8 bits
+uint8_t serv_socket_put8_blocking(unsigned long long ptr, uint8_t byte)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  uint8_t r = socket_put8_blocking(ptr, byte, true);
+  socketUnlock(s);
+  return r;
+}
+
+
+// Try to read N bytes from socket, giving N+1 byte result. Bottom N
+// bytes contain data and MSB is 0 if data is valid or non-zero if no
+// data is available.  Non-blocking on N-byte boundaries.
+void serv_socket_getN(void* result, unsigned long long ptr, int nbytes)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  socket_getN(result, ptr, nbytes, true);
+  socketUnlock(s);
+}
+
+// Try to write N bytes to socket.  Non-blocking on N-bytes boundaries,
+// returning 0 when no write performed.
+uint8_t serv_socket_putN(unsigned long long ptr, int nbytes, unsigned int* data)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  uint8_t r = socket_putN(ptr, nbytes, data, true);
+  socketUnlock(s);
+  return r;
+}
+
+// Try to read up to npackets N-byte packets from socket into consecutive
+// locations of result, returning the number of packets read
+int serv_socket_getN_batch(void* result, unsigned long long ptr, int nbytes, int npackets)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  int r = socket_getN_batch(result, ptr, nbytes, npackets, true);
+  socketUnlock(s);
+  return r;
+}
+
+// Try to write up to npackets N-byte packets to socket, returning the
+// number of packets written. Non-blocking on N-byte boundaries.
+int serv_socket_putN_batch(unsigned long long ptr, int nbytes, int npackets, unsigned int* data)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  int r = socket_putN_batch(ptr, nbytes, npackets, data, true);
+  socketUnlock(s);
+  return r;
+}
+
+// Fixed-width reads and writes of W-bit packets, returning 1 if a packet
+// was read or written
+#define SERV_SOCKET_FIXED_WIDTH(W)                                           \
+uint8_t serv_socket_get##W(void* result, unsigned long long ptr)             \
+{                                                                            \
+  serv_socket_state_t * s = socketLock(ptr);                                 \
+  uint8_t r = socket_get##W(result, ptr, true);                              \
+  socketUnlock(s);                                                           \
+  return r;                                                                  \
+}                                                                            \
+                                                                             \
+uint8_t serv_socket_put##W(unsigned long long ptr, unsigned int* data)       \
+{                                                                            \
+  serv_socket_state_t * s = socketLock(ptr);                                 \
+  uint8_t r = socket_put##W(ptr, data, true);                                \
+  socketUnlock(s);                                                           \
+  return r;                                                                  \
+}
+
+SERV_SOCKET_FIXED_WIDTH(32)
+SERV_SOCKET_FIXED_WIDTH(64)
+SERV_SOCKET_FIXED_WIDTH(128)
+SERV_SOCKET_FIXED_WIDTH(256)
+SERV_SOCKET_FIXED_WIDTH(512)
+
+// Try to read a length-prefixed message of up to maxbytes bytes, returning
+// its length, or -1 if none is available
+int serv_socket_get_msg(void* result, unsigned long long ptr, int maxbytes)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  int r = socket_get_msg(result, ptr, maxbytes, true);
+  socketUnlock(s);
+  return r;
+}
+
+// Try to write a length-prefixed message, returning 0 when no write
+// performed
+uint8_t serv_socket_put_msg(unsigned long long ptr, int nbytes, unsigned int* data)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  uint8_t r = socket_put_msg(ptr, nbytes, data, true);
+  socketUnlock(s);
+  return r;
+}
+
+// Try to read a record ending with a <name>_DELIMS delimiter, of up to
+// maxbytes bytes, returning its length, or -1 if none is available
+int serv_socket_get_until(void* result, unsigned long long ptr, int maxbytes)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  int r = socket_get_until(result, ptr, maxbytes, true);
+  socketUnlock(s);
+  return r;
+}
+
+// Blocking transfer of a file to the client, sending its path rather than
+// its contents unless <name>_BULK_BY_PATH is 0, which is the default when
+// the client is on another machine. Returns 0 on success, and -1 in
+// multi-client mode, which has no bulk transfers.
+int serv_socket_bulk_send(unsigned long long ptr, const char * file)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  int r = socket_bulk_send(ptr, file, true);
+  socketUnlock(s);
+  return r;
+}
+
+// Non-blocking receipt of a bulk transfer from the client, returning 1
+// once one is complete, 0 while waiting for it or -1 on failure, as in
+// multi-client mode. Files sent by path are only mapped from a client on
+// this machine, unless <name>_BULK_ACCEPT_PATH is set.
+int serv_socket_bulk_recv(unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  int r = socket_bulk_recv(ptr, true);
+  socketUnlock(s);
+  return r;
+}
+
+// Data of the completed bulk transfer, valid until released
+void* serv_socket_bulk_data(unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  void* r = s->bulk_data;
+  socketUnlock(s);
+  return r;
+}
+
+// Size in bytes of the completed bulk transfer
+uint64_t serv_socket_bulk_size(unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  uint64_t r = s->bulk_size;
+  socketUnlock(s);
+  return r;
+}
+
+// Release the completed bulk transfer, to receive the next one
+void serv_socket_bulk_release(unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  socket_bulk_release(ptr);
+  socketUnlock(s);
+}
+
+// Copy the hot path counters of a socket into stats
+void serv_socket_get_stats(unsigned long long ptr, socket_packet_stats_t* stats)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  *stats = s->stats;
+  socketUnlock(s);
+}
+
+// Note the current simulation cycle, for latencies to be measured in
+// cycles as well as in ns
+void serv_socket_set_cycle(unsigned long long ptr, uint64_t cycle)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  socket_set_cycle(ptr, cycle);
+  socketUnlock(s);
+}
+
+// Summarise one of the latency histograms of a socket, which being one of
+// the SOCKET_LATENCY_* indices
+void serv_socket_get_latency(unsigned long long ptr, int which, socket_latency_stats_t* stats)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  socket_get_latency(ptr, which, stats);
+  socketUnlock(s);
+}
+
+// Create an empty poll set
+unsigned long long serv_socket_poll_create(void)
+{
+  return socket_poll_create();
+}
+
+// Add a socket to a poll set, returning its bit index in the poll results
+int serv_socket_poll_add(unsigned long long set, unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  int r = socket_poll_add(set, ptr, true);
+  socketUnlock(s);
+  return r;
+}
+
+// Check all the sockets of a poll set at once, returning a mask of those
+// with a pending connection or data. Until the next poll, gets on sockets
+// not in the mask return no data without making a system call.
+uint64_t serv_socket_poll(unsigned long long set)
+{
+  return socket_poll(set);
+}
+
+// Take a socket out of a poll set, its index being reused by the next
+// socket added
+void serv_socket_poll_remove(unsigned long long set, unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  socket_poll_remove(set, ptr);
+  socketUnlock(s);
+}
+
+// Take all the sockets out of a poll set and free it. The set is invalid
+// afterwards, and its sockets can be added to another.
+void serv_socket_poll_destroy(unsigned long long set)
+{
+  socket_poll_destroy(set);
+}
+
+// Sleep until one of n sockets has a pending connection or data, for up to
+// timeout_us (forever if negative), returning its index in handles or -1
+int serv_socket_wait_any(unsigned long long* handles, int n, int64_t timeout_us)
+{
+  return socket_wait_any(handles, n, timeout_us, true);
+}
+
+// Non-blocking flush of the write-combining buffer, returning 1 when no
+// data is left pending
+uint8_t serv_socket_flush(unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  uint8_t r = socket_flush(ptr, true);
+  socketUnlock(s);
+  return r;
+}
+
+// Flush pending writes, waiting up to <name>_PUT_TIMEOUT_MS, then close
+// the socket and free its state. The path of a unix domain socket is
+// removed unless <name>_UNLINK is 0. The handle is invalid afterwards.
+void serv_socket_close(unsigned long long ptr)
+{
+  // The lock goes with the socket
+  socketLock(ptr);
+  socket_close(ptr, true, true);
+}
+
+// Close the socket straight away, dropping pending writes
+void serv_socket_destroy(unsigned long long ptr)
+{
+  // The lock goes with the socket
+  socketLock(ptr);
+  socket_close(ptr, true, false);
+}
+
+// client_socket API implementation
+////////////////////////////////////////////////////////////////////////////////
+unsigned long long client_socket_create(const char * name, unsigned int dflt_port)
+{
+  return socket_create(name, dflt_port);
+}
+
+// A wrapper for systems that don't allow passing strings
+unsigned long long client_socket_create_nameless(unsigned int dflt_port)
+{
+  char* s = getenv(ENV_DFLT_SOCKET_NAME);
+  if (s != NULL) return client_socket_create(s, dflt_port);
+  else {
+    logMsg(SOCKET_LOG_INFO, ENV_DFLT_SOCKET_NAME " environment variable not defined, "
+           "using default socket name %s instead", DFLT_SOCKET_NAME);
+    return client_socket_create(DFLT_SOCKET_NAME, dflt_port);
+  }
+}
+
+// Open and start connecting, the connection completing (or being retried
+// while the server is not up) on later calls, which fail until it has
+extern void client_socket_init(unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  socket_init(ptr, false);
+  socketUnlock(s);
+}
+
+// Non-blocking read of 8 bits
+uint32_t client_socket_get8(unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  uint32_t r = socket_get8(ptr, false);
+  socketUnlock(s);
+  return r;
+}
+
+// Non-blocking write of 8 bits
+uint8_t client_socket_put8(unsigned long long ptr, uint8_t byte)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  uint8_t r = socket_put8(ptr, byte, false);
+  socketUnlock(s);
+  return r;
+}
+
+// Blocking write of 8 bits
+uint8_t client_socket_put8_blocking(unsigned long long ptr, uint8_t byte)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  uint8_t r = socket_put8_blocking(ptr, byte, false);
+  socketUnlock(s);
+  return r;
+}
+
+// Try to read N bytes from socket, giving N+1 byte result. Bottom N
+// bytes contain data and MSB is 0 if data is valid or non-zero if no
+// data is available.  Non-blocking on N-byte boundaries.
+void client_socket_getN(void* result, unsigned long long ptr, int nbytes)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  socket_getN(result, ptr, nbytes, false);
+  socketUnlock(s);
+}
+
+// Try to write N bytes to socket.  Non-blocking on N-bytes boundaries,
+// returning 0 when no write performed.
+uint8_t client_socket_putN(unsigned long long ptr, int nbytes, unsigned int* data)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  uint8_t r = socket_putN(ptr, nbytes, data, false);
+  socketUnlock(s);
+  return r;
+}
+
+// Try to read up to npackets N-byte packets from socket into consecutive
+// locations of result, returning the number of packets read
+int client_socket_getN_batch(void* result, unsigned long long ptr, int nbytes, int npackets)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  int r = socket_getN_batch(result, ptr, nbytes, npackets, false);
+  socketUnlock(s);
+  return r;
+}
+
+// Try to write up to npackets N-byte packets to socket, returning the
+// number of packets written. Non-blocking on N-byte boundaries.
+int client_socket_putN_batch(unsigned long long ptr, int nbytes, int npackets, unsigned int* data)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  int r = socket_putN_batch(ptr, nbytes, npackets, data, false);
+  socketUnlock(s);
+  return r;
+}
+
+// Fixed-width reads and writes of W-bit packets, returning 1 if a packet
+// was read or written
+#define CLIENT_SOCKET_FIXED_WIDTH(W)                                           \
+uint8_t client_socket_get##W(void* result, unsigned long long ptr)             \
+{                                                                              \
+  serv_socket_state_t * s = socketLock(ptr);                                   \
+  uint8_t r = socket_get##W(result, ptr, false);                               \
+  socketUnlock(s);                                                             \
+  return r;                                                                    \
+}                                                                              \
+                                                                               \
+uint8_t client_socket_put##W(unsigned long long ptr, unsigned int* data)       \
+{                                                                              \
+  serv_socket_state_t * s = socketLock(ptr);                                   \
+  uint8_t r = socket_put##W(ptr, data, false);                                 \
+  socketUnlock(s);                                                             \
+  return r;                                                                    \
+}
+
+CLIENT_SOCKET_FIXED_WIDTH(32)
+CLIENT_SOCKET_FIXED_WIDTH(64)
+CLIENT_SOCKET_FIXED_WIDTH(128)
+CLIENT_SOCKET_FIXED_WIDTH(256)
+CLIENT_SOCKET_FIXED_WIDTH(512)
+
+// Try to read a length-prefixed message of up to maxbytes bytes, returning
+// its length, or -1 if none is available
+int client_socket_get_msg(void* result, unsigned long long ptr, int maxbytes)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  int r = socket_get_msg(result, ptr, maxbytes, false);
+  socketUnlock(s);
+  return r;
+}
+
+// Try to write a length-prefixed message, returning 0 when no write
+// performed
+uint8_t client_socket_put_msg(unsigned long long ptr, int nbytes, unsigned int* data)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  uint8_t r = socket_put_msg(ptr, nbytes, data, false);
+  socketUnlock(s);
+  return r;
+}
+
+// Try to read a record ending with a <name>_DELIMS delimiter, of up to
+// maxbytes bytes, returning its length, or -1 if none is available
+int client_socket_get_until(void* result, unsigned long long ptr, int maxbytes)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  int r = socket_get_until(result, ptr, maxbytes, false);
+  socketUnlock(s);
+  return r;
+}
+
+// Blocking transfer of a file to the server, sending its path rather than
+// its contents unless <name>_BULK_BY_PATH is 0, which is the default when
+// the server is on another machine. Returns 0 on success.
+int client_socket_bulk_send(unsigned long long ptr, const char * file)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  int r = socket_bulk_send(ptr, file, false);
+  socketUnlock(s);
+  return r;
+}
+
+// Non-blocking receipt of a bulk transfer from the server, returning 1
+// once one is complete, 0 while waiting for it or -1 on failure. Files
+// sent by path are only mapped from a server on this machine, unless
+// <name>_BULK_ACCEPT_PATH is set.
+int client_socket_bulk_recv(unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  int r = socket_bulk_recv(ptr, false);
+  socketUnlock(s);
+  return r;
+}
+
+// Data of the completed bulk transfer, valid until released
+void* client_socket_bulk_data(unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  void* r = s->bulk_data;
+  socketUnlock(s);
+  return r;
+}
+
+// Size in bytes of the completed bulk transfer
+uint64_t client_socket_bulk_size(unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  uint64_t r = s->bulk_size;
+  socketUnlock(s);
+  return r;
+}
+
+// Release the completed bulk transfer, to receive the next one
+void client_socket_bulk_release(unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  socket_bulk_release(ptr);
+  socketUnlock(s);
+}
+
+// Copy the hot path counters of a socket into stats
+void client_socket_get_stats(unsigned long long ptr, socket_packet_stats_t* stats)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  *stats = s->stats;
+  socketUnlock(s);
+}
+
+// Note the current simulation cycle, for latencies to be measured in
+// cycles as well as in ns
+void client_socket_set_cycle(unsigned long long ptr, uint64_t cycle)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  socket_set_cycle(ptr, cycle);
+  socketUnlock(s);
+}
+
+// Summarise one of the latency histograms of a socket, which being one of
+// the SOCKET_LATENCY_* indices
+void client_socket_get_latency(unsigned long long ptr, int which, socket_latency_stats_t* stats)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  socket_get_latency(ptr, which, stats);
+  socketUnlock(s);
+}
+
+// Create an empty poll set. Server and client sockets can share one.
+unsigned long long client_socket_poll_create(void)
+{
+  return socket_poll_create();
+}
+
+// Add a socket to a poll set, returning its bit index in the poll results
+int client_socket_poll_add(unsigned long long set, unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  int r = socket_poll_add(set, ptr, false);
+  socketUnlock(s);
+  return r;
+}
+
+// Check all the sockets of a poll set at once, returning a mask of those
+// with data, or still connecting. Until the next poll, gets on sockets
+// not in the mask return no data without making a system call.
+uint64_t client_socket_poll(unsigned long long set)
+{
+  return socket_poll(set);
+}
+
+// Take a socket out of a poll set, its index being reused by the next
+// socket added
+void client_socket_poll_remove(unsigned long long set, unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  socket_poll_remove(set, ptr);
+  socketUnlock(s);
+}
+
+// Take all the sockets out of a poll set and free it. The set is invalid
+// afterwards, and its sockets can be added to another.
+void client_socket_poll_destroy(unsigned long long set)
+{
+  socket_poll_destroy(set);
+}
+
+// Sleep until one of n sockets has data, for up to timeout_us (forever if
+// negative), returning its index in handles or -1
+int client_socket_wait_any(unsigned long long* handles, int n, int64_t timeout_us)
+{
+  return socket_wait_any(handles, n, timeout_us, false);
+}
+
+// Non-blocking flush of the write-combining buffer, returning 1 when no
+// data is left pending
+uint8_t client_socket_flush(unsigned long long ptr)
+{
+  serv_socket_state_t * s = socketLock(ptr);
+  uint8_t r = socket_flush(ptr, false);
+  socketUnlock(s);
+  return r;
+}
+
+// Flush pending writes, waiting up to <name>_PUT_TIMEOUT_MS, then close
+// the socket and free its state. The handle is invalid afterwards.
+void client_socket_close(unsigned long long ptr)
+{
+  // The lock goes with the socket
+  socketLock(ptr);
+  socket_close(ptr, false, true);
+}
+
+// Close the socket straight away, dropping pending writes
+void client_socket_destroy(unsigned long long ptr)
 {
-  socket_putN(ptr, nbytes, data, false);
+  // The lock goes with the socket
+  socketLock(ptr);
+  socket_close(ptr, false, false);
 }
 
 #undef ENV_DFLT_SOCKET_NAME
@@ -38,11 +38,86 @@
 
 #include <stdint.h>
 
+// Hot path counters of a socket
+////////////////////////////////////////////////////////////////////////////////
+typedef struct {
+  uint64_t reads;          // get calls that delivered data
+  uint64_t empty_reads;    // get calls that found no data
+  uint64_t writes;         // put calls that accepted data
+  uint64_t full_writes;    // put calls that could not accept data
+  uint64_t bytes_in;       // bytes delivered by get calls
+  uint64_t bytes_out;      // bytes accepted by put calls
+  uint64_t partial_reads;  // packets completed by a later get call
+  uint64_t partial_writes; // packets whose tail was left for later calls
+  uint64_t read_calls;     // reads from the connection (socket or ring)
+  uint64_t write_calls;    // writes to the connection (socket or ring)
+  uint64_t blocked_ns;     // time spent waiting in blocking calls
+  uint64_t connections;    // connections established
+} socket_packet_stats_t;
+
+// Latency distributions, recorded when <name>_LATENCY is non-zero: from the
+// read bringing a packet in to the get delivering it (rx), and from the put
+// accepting a packet to the write sending it (tx), in ns or, once the
+// simulation cycle is supplied with set_cycle, in cycles. Over shared memory
+// or with an I/O thread, rx runs from the first get finding a packet in the
+// ring, the time spent reaching the ring not being seen.
+#define SOCKET_LATENCY_RX_NS 0
+#define SOCKET_LATENCY_TX_NS 1
+#define SOCKET_LATENCY_RX_CYCLES 2
+#define SOCKET_LATENCY_TX_CYCLES 3
+
+typedef struct {
+  uint64_t count;
+  uint64_t min;
+  uint64_t mean;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t p999;
+  uint64_t max;
+} socket_latency_stats_t;
+
+// Logging. Messages at or below the log level are written as "---- " lines,
+// warnings and errors to stderr and the rest to stdout, or passed to the
+// handler if one is set; the others are not even formatted. The level is
+// taken from SOCKET_PACKET_UTILS_LOG_LEVEL (a number, or none, error, warn,
+// info or debug) unless set with socket_packet_set_log_level, and is info
+// by default. Connections being made and lost are only logged at debug.
+// Errors the library cannot recover from are logged at error before it
+// exits the process.
+#define SOCKET_LOG_NONE 0
+#define SOCKET_LOG_ERROR 1
+#define SOCKET_LOG_WARN 2
+#define SOCKET_LOG_INFO 3
+#define SOCKET_LOG_DEBUG 4
+
+// Log handler, given the level, the message without newline and the
+// argument it was set with. It may be called from any thread using a socket.
+typedef void (*socket_packet_log_fn)(int level, const char * msg, void * arg);
+
 // API
 ////////////////////////////////////////////////////////////////////////////////
+// Sockets are referred to by the handles the create functions return, which
+// index the library's socket table, 0 never being a valid one. A handle is
+// only valid until its socket is destroyed: using it afterwards is reported
+// as an error, even once a new socket reuses the entry.
+//
+// Threads: a socket belongs to one thread at a time, but different sockets
+// may be used from different threads at once, create and destroy included
+// (the socket table and the shared io_uring ring are locked). A socket
+// created with <name>_THREAD_SAFE set may be used from several threads at
+// once, each call holding its lock, at the cost of a lock per call. A poll
+// set belongs to one thread, which may poll thread-safe sockets that other
+// threads are using. Destroying a socket another thread is using is an
+// error in either mode. A destroyed socket leaves its poll set, and
+// destroying a poll set takes its sockets out of it, so either may go
+// first.
 #ifdef __cplusplus
 extern "C" {
 #endif
+  // Set before creating sockets, for the handler
+  extern void socket_packet_set_log_level(int level);
+  extern void socket_packet_set_log_handler(socket_packet_log_fn fn, void * arg);
   extern unsigned long long serv_socket_create(const char * name, unsigned int dflt_port);
   extern unsigned long long serv_socket_create_nameless(unsigned int dflt_port);
   extern void serv_socket_init(unsigned long long ptr);
@@ -51,10 +126,78 @@ extern "C" {
   extern uint8_t serv_socket_put8_blocking(unsigned long long ptr, uint8_t byte);
   extern void serv_socket_getN(void* result, unsigned long long ptr, int nbytes);
   extern uint8_t serv_socket_putN(unsigned long long ptr, int nbytes, unsigned int* data);
+  extern int serv_socket_getN_batch(void* result, unsigned long long ptr, int nbytes, int npackets);
+  extern int serv_socket_putN_batch(unsigned long long ptr, int nbytes, int npackets, unsigned int* data);
+  extern uint8_t serv_socket_get32(void* result, unsigned long long ptr);
+  extern uint8_t serv_socket_put32(unsigned long long ptr, unsigned int* data);
+  extern uint8_t serv_socket_get64(void* result, unsigned long long ptr);
+  extern uint8_t serv_socket_put64(unsigned long long ptr, unsigned int* data);
+  extern uint8_t serv_socket_get128(void* result, unsigned long long ptr);
+  extern uint8_t serv_socket_put128(unsigned long long ptr, unsigned int* data);
+  extern uint8_t serv_socket_get256(void* result, unsigned long long ptr);
+  extern uint8_t serv_socket_put256(unsigned long long ptr, unsigned int* data);
+  extern uint8_t serv_socket_get512(void* result, unsigned long long ptr);
+  extern uint8_t serv_socket_put512(unsigned long long ptr, unsigned int* data);
+  extern int serv_socket_get_msg(void* result, unsigned long long ptr, int maxbytes);
+  extern uint8_t serv_socket_put_msg(unsigned long long ptr, int nbytes, unsigned int* data);
+  extern int serv_socket_get_until(void* result, unsigned long long ptr, int maxbytes);
+  extern uint8_t serv_socket_flush(unsigned long long ptr);
+  extern int serv_socket_bulk_send(unsigned long long ptr, const char * file);
+  extern int serv_socket_bulk_recv(unsigned long long ptr);
+  extern void* serv_socket_bulk_data(unsigned long long ptr);
+  extern uint64_t serv_socket_bulk_size(unsigned long long ptr);
+  extern void serv_socket_bulk_release(unsigned long long ptr);
+  extern void serv_socket_get_stats(unsigned long long ptr, socket_packet_stats_t* stats);
+  extern void serv_socket_set_cycle(unsigned long long ptr, uint64_t cycle);
+  extern void serv_socket_get_latency(unsigned long long ptr, int which, socket_latency_stats_t* stats);
+  extern unsigned long long serv_socket_poll_create(void);
+  extern int serv_socket_poll_add(unsigned long long set, unsigned long long ptr);
+  extern uint64_t serv_socket_poll(unsigned long long set);
+  extern void serv_socket_poll_remove(unsigned long long set, unsigned long long ptr);
+  extern void serv_socket_poll_destroy(unsigned long long set);
+  extern int serv_socket_wait_any(unsigned long long* handles, int n, int64_t timeout_us);
+  extern void serv_socket_close(unsigned long long ptr);
+  extern void serv_socket_destroy(unsigned long long ptr);
   extern unsigned long long client_socket_create(const char * name, unsigned int dflt_port);
+  extern unsigned long long client_socket_create_nameless(unsigned int dflt_port);
   extern void client_socket_init(unsigned long long ptr);
+  extern uint32_t client_socket_get8(unsigned long long ptr);
+  extern uint8_t client_socket_put8(unsigned long long ptr, uint8_t byte);
   extern uint8_t client_socket_put8_blocking(unsigned long long ptr, uint8_t byte);
   extern void client_socket_getN(void* result, unsigned long long ptr, int nbytes);
+  extern uint8_t client_socket_putN(unsigned long long ptr, int nbytes, unsigned int* data);
+  extern int client_socket_getN_batch(void* result, unsigned long long ptr, int nbytes, int npackets);
+  extern int client_socket_putN_batch(unsigned long long ptr, int nbytes, int npackets, unsigned int* data);
+  extern uint8_t client_socket_get32(void* result, unsigned long long ptr);
+  extern uint8_t client_socket_put32(unsigned long long ptr, unsigned int* data);
+  extern uint8_t client_socket_get64(void* result, unsigned long long ptr);
+  extern uint8_t client_socket_put64(unsigned long long ptr, unsigned int* data);
+  extern uint8_t client_socket_get128(void* result, unsigned long long ptr);
+  extern uint8_t client_socket_put128(unsigned long long ptr, unsigned int* data);
+  extern uint8_t client_socket_get256(void* result, unsigned long long ptr);
+  extern uint8_t client_socket_put256(unsigned long long ptr, unsigned int* data);
+  extern uint8_t client_socket_get512(void* result, unsigned long long ptr);
+  extern uint8_t client_socket_put512(unsigned long long ptr, unsigned int* data);
+  extern int client_socket_get_msg(void* result, unsigned long long ptr, int maxbytes);
+  extern uint8_t client_socket_put_msg(unsigned long long ptr, int nbytes, unsigned int* data);
+  extern int client_socket_get_until(void* result, unsigned long long ptr, int maxbytes);
+  extern uint8_t client_socket_flush(unsigned long long ptr);
+  extern int client_socket_bulk_send(unsigned long long ptr, const char * file);
+  extern int client_socket_bulk_recv(unsigned long long ptr);
+  extern void* client_socket_bulk_data(unsigned long long ptr);
+  extern uint64_t client_socket_bulk_size(unsigned long long ptr);
+  extern void client_socket_bulk_release(unsigned long long ptr);
+  extern void client_socket_get_stats(unsigned long long ptr, socket_packet_stats_t* stats);
+  extern void client_socket_set_cycle(unsigned long long ptr, uint64_t cycle);
+  extern void client_socket_get_latency(unsigned long long ptr, int which, socket_latency_stats_t* stats);
+  extern unsigned long long client_socket_poll_create(void);
+  extern int client_socket_poll_add(unsigned long long set, unsigned long long ptr);
+  extern uint64_t client_socket_poll(unsigned long long set);
+  extern void client_socket_poll_remove(unsigned long long set, unsigned long long ptr);
+  extern void client_socket_poll_destroy(unsigned long long set);
+  extern int client_socket_wait_any(unsigned long long* handles, int n, int64_t timeout_us);
+  extern void client_socket_close(unsigned long long ptr);
+  extern void client_socket_destroy(unsigned long long ptr);
 #ifdef __cplusplus
 }
 #endif